@@ -1,101 +1,59 @@
 // vim: set ai et ts=4 sw=4:
 
 #include <Arduino.h>
+#include <atomic>
 #include <si5351.h>
+#include "si5351_private.h"
 
-#define SI5351_ADDRESS 0x60
-#define I2C_FREQUENCY 100000U
-
-// Private procedures.
-void si5351_writeBulk(uint8_t baseaddr, int32_t P1, int32_t P2, int32_t P3, uint8_t divBy4, si5351RDiv_t rdiv);
-uint8_t si5351_write(uint8_t reg, uint8_t data);
-
-// See http://www.silabs.com/Support%20Documents/TechnicalDocs/AN619.pdf
-enum {
-    SI5351_REGISTER_0_DEVICE_STATUS                       = 0,
-    SI5351_REGISTER_1_INTERRUPT_STATUS_STICKY             = 1,
-    SI5351_REGISTER_2_INTERRUPT_STATUS_MASK               = 2,
-    SI5351_REGISTER_3_OUTPUT_ENABLE_CONTROL               = 3,
-    SI5351_REGISTER_9_OEB_PIN_ENABLE_CONTROL              = 9,
-    SI5351_REGISTER_15_PLL_INPUT_SOURCE                   = 15,
-    SI5351_REGISTER_16_CLK0_CONTROL                       = 16,
-    SI5351_REGISTER_17_CLK1_CONTROL                       = 17,
-    SI5351_REGISTER_18_CLK2_CONTROL                       = 18,
-    SI5351_REGISTER_19_CLK3_CONTROL                       = 19,
-    SI5351_REGISTER_20_CLK4_CONTROL                       = 20,
-    SI5351_REGISTER_21_CLK5_CONTROL                       = 21,
-    SI5351_REGISTER_22_CLK6_CONTROL                       = 22,
-    SI5351_REGISTER_23_CLK7_CONTROL                       = 23,
-    SI5351_REGISTER_24_CLK3_0_DISABLE_STATE               = 24,
-    SI5351_REGISTER_25_CLK7_4_DISABLE_STATE               = 25,
-    SI5351_REGISTER_42_MULTISYNTH0_PARAMETERS_1           = 42,
-    SI5351_REGISTER_43_MULTISYNTH0_PARAMETERS_2           = 43,
-    SI5351_REGISTER_44_MULTISYNTH0_PARAMETERS_3           = 44,
-    SI5351_REGISTER_45_MULTISYNTH0_PARAMETERS_4           = 45,
-    SI5351_REGISTER_46_MULTISYNTH0_PARAMETERS_5           = 46,
-    SI5351_REGISTER_47_MULTISYNTH0_PARAMETERS_6           = 47,
-    SI5351_REGISTER_48_MULTISYNTH0_PARAMETERS_7           = 48,
-    SI5351_REGISTER_49_MULTISYNTH0_PARAMETERS_8           = 49,
-    SI5351_REGISTER_50_MULTISYNTH1_PARAMETERS_1           = 50,
-    SI5351_REGISTER_51_MULTISYNTH1_PARAMETERS_2           = 51,
-    SI5351_REGISTER_52_MULTISYNTH1_PARAMETERS_3           = 52,
-    SI5351_REGISTER_53_MULTISYNTH1_PARAMETERS_4           = 53,
-    SI5351_REGISTER_54_MULTISYNTH1_PARAMETERS_5           = 54,
-    SI5351_REGISTER_55_MULTISYNTH1_PARAMETERS_6           = 55,
-    SI5351_REGISTER_56_MULTISYNTH1_PARAMETERS_7           = 56,
-    SI5351_REGISTER_57_MULTISYNTH1_PARAMETERS_8           = 57,
-    SI5351_REGISTER_58_MULTISYNTH2_PARAMETERS_1           = 58,
-    SI5351_REGISTER_59_MULTISYNTH2_PARAMETERS_2           = 59,
-    SI5351_REGISTER_60_MULTISYNTH2_PARAMETERS_3           = 60,
-    SI5351_REGISTER_61_MULTISYNTH2_PARAMETERS_4           = 61,
-    SI5351_REGISTER_62_MULTISYNTH2_PARAMETERS_5           = 62,
-    SI5351_REGISTER_63_MULTISYNTH2_PARAMETERS_6           = 63,
-    SI5351_REGISTER_64_MULTISYNTH2_PARAMETERS_7           = 64,
-    SI5351_REGISTER_65_MULTISYNTH2_PARAMETERS_8           = 65,
-    SI5351_REGISTER_66_MULTISYNTH3_PARAMETERS_1           = 66,
-    SI5351_REGISTER_67_MULTISYNTH3_PARAMETERS_2           = 67,
-    SI5351_REGISTER_68_MULTISYNTH3_PARAMETERS_3           = 68,
-    SI5351_REGISTER_69_MULTISYNTH3_PARAMETERS_4           = 69,
-    SI5351_REGISTER_70_MULTISYNTH3_PARAMETERS_5           = 70,
-    SI5351_REGISTER_71_MULTISYNTH3_PARAMETERS_6           = 71,
-    SI5351_REGISTER_72_MULTISYNTH3_PARAMETERS_7           = 72,
-    SI5351_REGISTER_73_MULTISYNTH3_PARAMETERS_8           = 73,
-    SI5351_REGISTER_74_MULTISYNTH4_PARAMETERS_1           = 74,
-    SI5351_REGISTER_75_MULTISYNTH4_PARAMETERS_2           = 75,
-    SI5351_REGISTER_76_MULTISYNTH4_PARAMETERS_3           = 76,
-    SI5351_REGISTER_77_MULTISYNTH4_PARAMETERS_4           = 77,
-    SI5351_REGISTER_78_MULTISYNTH4_PARAMETERS_5           = 78,
-    SI5351_REGISTER_79_MULTISYNTH4_PARAMETERS_6           = 79,
-    SI5351_REGISTER_80_MULTISYNTH4_PARAMETERS_7           = 80,
-    SI5351_REGISTER_81_MULTISYNTH4_PARAMETERS_8           = 81,
-    SI5351_REGISTER_82_MULTISYNTH5_PARAMETERS_1           = 82,
-    SI5351_REGISTER_83_MULTISYNTH5_PARAMETERS_2           = 83,
-    SI5351_REGISTER_84_MULTISYNTH5_PARAMETERS_3           = 84,
-    SI5351_REGISTER_85_MULTISYNTH5_PARAMETERS_4           = 85,
-    SI5351_REGISTER_86_MULTISYNTH5_PARAMETERS_5           = 86,
-    SI5351_REGISTER_87_MULTISYNTH5_PARAMETERS_6           = 87,
-    SI5351_REGISTER_88_MULTISYNTH5_PARAMETERS_7           = 88,
-    SI5351_REGISTER_89_MULTISYNTH5_PARAMETERS_8           = 89,
-    SI5351_REGISTER_90_MULTISYNTH6_PARAMETERS             = 90,
-    SI5351_REGISTER_91_MULTISYNTH7_PARAMETERS             = 91,
-    SI5351_REGISTER_92_CLOCK_6_7_OUTPUT_DIVIDER           = 92,
-    SI5351_REGISTER_165_CLK0_INITIAL_PHASE_OFFSET         = 165,
-    SI5351_REGISTER_166_CLK1_INITIAL_PHASE_OFFSET         = 166,
-    SI5351_REGISTER_167_CLK2_INITIAL_PHASE_OFFSET         = 167,
-    SI5351_REGISTER_168_CLK3_INITIAL_PHASE_OFFSET         = 168,
-    SI5351_REGISTER_169_CLK4_INITIAL_PHASE_OFFSET         = 169,
-    SI5351_REGISTER_170_CLK5_INITIAL_PHASE_OFFSET         = 170,
-    SI5351_REGISTER_177_PLL_RESET                         = 177,
-    SI5351_REGISTER_183_CRYSTAL_INTERNAL_LOAD_CAPACITANCE = 183
-};
-
-typedef enum {
-    SI5351_CRYSTAL_LOAD_6PF  = (1<<6),
-    SI5351_CRYSTAL_LOAD_8PF  = (2<<6),
-    SI5351_CRYSTAL_LOAD_10PF = (3<<6)
-} si5351CrystalLoad_t;
+// Fine tuning through the VC pin is used within this share of the pull range,
+// the VC voltage stays away from the rails where Kv is less linear.
+#define SI5351_VCXO_FINE_PERCENT 90
+
+// Bus recovery: clock pulses to free SDA, SCL half period and how long
+// a slave may stretch the clock before SCL is considered stuck.
+#define SI5351_RECOVERY_CLOCKS 9
+#define SI5351_RECOVERY_HALF_PERIOD_US 5
+#define SI5351_RECOVERY_STRETCH_US 1000
 
 int32_t si5351Correction;
+si5351Variant_t si5351Variant = SI5351_VARIANT_A;
+
+// I2C pins as passed to si5351_Init(), 0 and 0 mean standard ESP32 pins
+uint8_t si5351I2cSda = 0;
+uint8_t si5351I2cScl = 0;
+
+// Registers written so far, replayed after bus recovery
+uint8_t si5351Shadow[256];
+uint8_t si5351ShadowValid[256/8];
+// Registers being written while the bus is recovered, none if len is 0.
+// The shadow already has their new values but the chip may not.
+uint8_t si5351PendingReg = 0;
+uint8_t si5351PendingLen = 0;
+si5351BusStats_t si5351BusStats;
+uint32_t si5351Transfers = 0;
+uint32_t si5351Bytes = 0;
+uint32_t si5351PLLResets = 0;
+
+// Configuration as set up so far, published by si5351_publish()
+si5351PLLConfig_t si5351PLLSetup[2];
+uint8_t si5351PLLSetupValid[2];
+si5351OutputSetup_t si5351OutputSetup[3];
+uint8_t si5351Enabled = 0;
+int32_t si5351VCXOOffset = 0;
+
+// Snapshot latch: while the sequence is odd readers use the second copy and
+// the writer updates the first one, then the other way around. The copies are
+// kept as relaxed atomic words so the fences order them (Boehm's seqlock).
+#define SI5351_SNAPSHOT_WORDS ((sizeof(si5351Snapshot_t) + 3) / 4)
+std::atomic<uint32_t> si5351Snapshots[2][SI5351_SNAPSHOT_WORDS];
+std::atomic<uint32_t> si5351SnapshotSeq(0);
+
+// VCXO state, see si5351_TuneVCXO()
+uint16_t si5351VCXOApr = 0;
+si5351VCOutput_t si5351VCOutput = NULL;
+uint16_t si5351VddMillivolts = 3300;
+int32_t si5351VCXOCenter = 0;
+uint8_t si5351VCXOOutput = 0;
 
 /**
  * @brief Initializes Si5351. Call this function before doing anything else.
@@ -109,15 +67,21 @@ int32_t si5351Correction;
  */
 void si5351_Init(int32_t correction, uint8_t i2c_sda, uint8_t i2c_scl) {
     si5351Correction = correction;
+    si5351I2cSda = i2c_sda;
+    si5351I2cScl = i2c_scl;
+    memset(si5351ShadowValid, 0, sizeof(si5351ShadowValid));
+    memset(si5351PLLSetupValid, 0, sizeof(si5351PLLSetupValid));
+    memset(si5351OutputSetup, 0, sizeof(si5351OutputSetup));
+    si5351Enabled = 0;
+    si5351VCXOCenter = 0;
+    si5351Staging = 0;
+    memset(&si5351BusStats, 0, sizeof(si5351BusStats));
+    si5351Transfers = 0;
+    si5351Bytes = 0;
+    si5351PLLResets = 0;
 
     // Start i2c comms
-    if(i2c_sda == 0 && i2c_scl == 0) {
-        // using standard ESP32 I2C pins (SDA: 21, SCL: 22)
-        Wire.begin();
-    }
-    else {
-        Wire.begin(i2c_sda, i2c_scl, I2C_FREQUENCY);
-    }
+    si5351_beginWire();
 
     // Disable all outputs by setting CLKx_DIS high
     si5351_write(SI5351_REGISTER_3_OUTPUT_ENABLE_CONTROL, 0xFF);
@@ -135,6 +99,8 @@ void si5351_Init(int32_t correction, uint8_t i2c_sda, uint8_t i2c_scl) {
     // Set the load capacitance for the XTAL
     si5351CrystalLoad_t crystalLoad = SI5351_CRYSTAL_LOAD_10PF;
     si5351_write(SI5351_REGISTER_183_CRYSTAL_INTERNAL_LOAD_CAPACITANCE, crystalLoad);
+
+    si5351_publish();
 }
 
 /**
@@ -156,22 +122,19 @@ void si5351_Init(int32_t correction) {
  * @param conf 
  */
 void si5351_SetupPLL(si5351PLL_t pll, si5351PLLConfig_t* conf) {
-    int32_t P1, P2, P3;
-    int32_t mult = conf->mult;
-    int32_t num = conf->num;
-    int32_t denom = conf->denom;
-
-    P1 = 128 * mult + (128 * num)/denom - 512;
-    // P2 = 128 * num - denom * ((128 * num)/denom);
-    P2 = (128 * num) % denom;
-    P3 = denom;
+    uint8_t regs[8];
+    si5351_encodePLL(conf, regs);
 
     // Get the appropriate base address for the PLL registers
     uint8_t baseaddr = (pll == SI5351_PLL_A ? 26 : 34);
-    si5351_writeBulk(baseaddr, P1, P2, P3, 0, si5351RDiv_t::SI5351_R_DIV_1);
+    si5351_writeBurst(baseaddr, regs, 8);
 
     // Reset both PLLs
     si5351_write(SI5351_REGISTER_177_PLL_RESET, (1<<7) | (1<<5) );
+
+    si5351PLLSetup[pll] = *conf;
+    si5351PLLSetupValid[pll] = 1;
+    si5351_publish();
 }
 
 /**
@@ -187,9 +150,6 @@ void si5351_SetupPLL(si5351PLL_t pll, si5351PLLConfig_t* conf) {
 int si5351_SetupOutput(uint8_t output, si5351PLL_t pllSource, si5351DriveStrength_t driveStrength, si5351OutputConfig_t* conf, uint8_t phaseOffset) {
     int32_t div = conf->div;
     int32_t num = conf->num;
-    int32_t denom = conf->denom;
-    uint8_t divBy4 = 0;
-    int32_t P1, P2, P3;
 
     if(output > 2) {
         return 1;
@@ -200,18 +160,8 @@ int si5351_SetupOutput(uint8_t output, si5351PLL_t pllSource, si5351DriveStrengt
         return 2;
     }
 
-    if(div == 4) {
-        // special DIVBY4 case, see AN619 4.1.3
-        P1 = 0;
-        P2 = 0;
-        P3 = 1;
-        divBy4 = 0x3;
-    } else {
-        P1 = 128 * div + ((128 * num)/denom) - 512;
-        // P2 = 128 * num - denom * (128 * num)/denom;
-        P2 = (128 * num) % denom;
-        P3 = denom;
-    }
+    uint8_t regs[8];
+    uint8_t integerMode = si5351_encodeOutput(conf, regs);
 
     // Get the register addresses for given channel
     uint8_t baseaddr = 0;
@@ -240,18 +190,186 @@ int si5351_SetupOutput(uint8_t output, si5351PLL_t pllSource, si5351DriveStrengt
         clkControl |= (1 << 5); // Uses PLLB
     }
 
-    if((conf->allowIntegerMode) && ((num == 0)||(div == 4))) {
+    if(integerMode) {
         // use integer mode
         clkControl |= (1 << 6);
     }
 
-    si5351_write(clkControlRegister, clkControl);
-    si5351_writeBulk(baseaddr, P1, P2, P3, divBy4, conf->rdiv);
-    si5351_write(phaseOffsetRegister, (phaseOffset & 0x7F));
+    uint8_t shared = 0;
+    if(output == 0) {
+        si5351_unshareMS0(pllSource, regs, phaseOffset & 0x7F);
+    } else {
+        shared = si5351_shareMS0(output, pllSource, driveStrength, regs, integerMode, phaseOffset & 0x7F);
+    }
+
+    if(!shared) {
+        // Control register last, a shared output switches to its own MS once it's programmed
+        si5351_writeBurst(baseaddr, regs, 8);
+        si5351_write(phaseOffsetRegister, (phaseOffset & 0x7F));
+        si5351_write(clkControlRegister, clkControl);
+    }
+
+    si5351OutputSetup[output].valid = 1;
+    si5351OutputSetup[output].pll = pllSource;
+    si5351OutputSetup[output].driveStrength = driveStrength;
+    si5351OutputSetup[output].conf = *conf;
+    memcpy(si5351OutputSetup[output].ms, regs, sizeof(regs));
+    si5351OutputSetup[output].intMode = integerMode;
+    si5351OutputSetup[output].phaseOffset = phaseOffset & 0x7F;
+    si5351OutputSetup[output].sharesMS0 = shared;
+    si5351_publish();
 
     return 0;
 }
 
+/**
+ * @brief Programs an output from a register image, e.g. one calculated by si5351_CalcFast().
+ * Only the registers that differ from the ones written before are sent, the PLL is
+ * reset only if it changes. Other outputs on the same PLL keep running.
+ * 
+ * @param output 
+ * @param pll 
+ * @param driveStrength 
+ * @param image 
+ * @return int Returns 0 on success, != 0 otherwise.
+ */
+int si5351_SetupImage(uint8_t output, si5351PLL_t pll, si5351DriveStrength_t driveStrength, const si5351RegImage_t* image) {
+    if(output > 2) {
+        return 1;
+    }
+
+    uint8_t clkControlRegister = SI5351_REGISTER_16_CLK0_CONTROL + output;
+    uint8_t msBaseaddr = SI5351_REGISTER_42_MULTISYNTH0_PARAMETERS_1 + 8*output;
+    uint8_t phaseOffsetRegister = SI5351_REGISTER_165_CLK0_INITIAL_PHASE_OFFSET + output;
+    uint8_t pllBaseaddr = (pll == SI5351_PLL_A ? 26 : 34);
+    uint8_t result = 0;
+
+    uint8_t clkControl = 0x0C | driveStrength; // clock not inverted, powered up
+    if(pll == SI5351_PLL_B) {
+        clkControl |= (1 << 5); // Uses PLLB
+    }
+    if(image->intMode) {
+        clkControl |= (1 << 6);
+    }
+
+    uint8_t shared = 0;
+    if(output == 0) {
+        result |= si5351_unshareMS0(pll, image->ms, 0);
+    } else {
+        shared = si5351_shareMS0(output, pll, driveStrength, image->ms, image->intMode, 0);
+    }
+
+    if(!shared) {
+        result |= si5351_writeMasked(msBaseaddr, image->ms, si5351_shadowDiff(msBaseaddr, image->ms));
+        result |= si5351_writeChanged(phaseOffsetRegister, 0);
+        result |= si5351_writeChanged(clkControlRegister, clkControl);
+    }
+
+    uint8_t pllMask = si5351_shadowDiff(pllBaseaddr, image->pll);
+    if(pllMask) {
+        result |= si5351_writeMasked(pllBaseaddr, image->pll, pllMask);
+        // Reset only this PLL, outputs on the other one keep running
+        result |= si5351_write(SI5351_REGISTER_177_PLL_RESET, (pll == SI5351_PLL_A) ? (1<<5) : (1<<7));
+    }
+
+    si5351RDiv_t rdiv;
+    si5351_decodeBulk(image->pll, &si5351PLLSetup[pll].mult, &si5351PLLSetup[pll].num, &si5351PLLSetup[pll].denom, &rdiv);
+    si5351PLLSetupValid[pll] = 1;
+    si5351OutputSetup_t* setup = &si5351OutputSetup[output];
+    si5351_decodeBulk(image->ms, &setup->conf.div, &setup->conf.num, &setup->conf.denom, &setup->conf.rdiv);
+    setup->conf.allowIntegerMode = image->intMode;
+    memcpy(setup->ms, image->ms, sizeof(setup->ms));
+    setup->intMode = image->intMode;
+    setup->valid = 1;
+    setup->pll = pll;
+    setup->driveStrength = driveStrength;
+    setup->phaseOffset = 0;
+    setup->sharesMS0 = shared;
+    si5351_publish();
+
+    return result;
+}
+
+/**
+ * @brief Routes CLK1 or CLK2 from MS0 if CLK0 already gives the same frequency and phase.
+ * MS0 is the only MultiSynth the CLK control source select can fan out, see AN619 CLKx_SRC.
+ * The output keeps its own R divider, it gets the value of R0.
+ * 
+ * @param output 1 or 2
+ * @param pll 
+ * @param driveStrength 
+ * @param ms MS register values the output needs
+ * @param integerMode 
+ * @param phaseOffset 
+ * @return uint8_t Returns 1 if the output runs from MS0 now, 0 if it needs its own MS.
+ */
+uint8_t si5351_shareMS0(uint8_t output, si5351PLL_t pll, si5351DriveStrength_t driveStrength, const uint8_t* ms, uint8_t integerMode, uint8_t phaseOffset) {
+    si5351OutputSetup_t* source = &si5351OutputSetup[0];
+    if(!source->valid || (source->pll != pll) || (source->phaseOffset != phaseOffset) ||
+       si5351_shadowDiff(SI5351_REGISTER_42_MULTISYNTH0_PARAMETERS_1, ms)) {
+        return 0;
+    }
+
+    // R divider first, so the output never runs from MS0 with a stale one
+    uint8_t rdivRegister = SI5351_REGISTER_42_MULTISYNTH0_PARAMETERS_1 + 8*output + 2;
+    uint8_t rdiv = ms[2] & 0x70;
+    if(si5351_shadowValid(rdivRegister)) {
+        rdiv |= si5351Shadow[rdivRegister] & 0x8F;
+    }
+    si5351_writeChanged(rdivRegister, rdiv);
+
+    uint8_t clkControl = 0x08 | driveStrength; // clock not inverted, powered up, MS0 as the source
+    if(pll == SI5351_PLL_B) {
+        clkControl |= (1 << 5);
+    }
+    if(integerMode) {
+        clkControl |= (1 << 6);
+    }
+    si5351_writeChanged(SI5351_REGISTER_16_CLK0_CONTROL + output, clkControl);
+    return 1;
+}
+
+/**
+ * @brief Gives the outputs that run from MS0 their own MS back before CLK0 changes.
+ * Does nothing if the new CLK0 settings are the same.
+ * 
+ * @param pll new PLL of CLK0
+ * @param ms new MS0 register values
+ * @param phaseOffset new phase offset of CLK0
+ * @return uint8_t Returns 0 on success, != 0 otherwise.
+ */
+uint8_t si5351_unshareMS0(si5351PLL_t pll, const uint8_t* ms, uint8_t phaseOffset) {
+    si5351OutputSetup_t* source = &si5351OutputSetup[0];
+    if(!source->valid || ((source->pll == pll) && (source->phaseOffset == phaseOffset) &&
+       !si5351_shadowDiff(SI5351_REGISTER_42_MULTISYNTH0_PARAMETERS_1, ms))) {
+        return 0;
+    }
+
+    uint8_t result = 0;
+    for(uint8_t output = 1; output <= 2; output++) {
+        si5351OutputSetup_t* setup = &si5351OutputSetup[output];
+        if(!setup->valid || !setup->sharesMS0) {
+            continue;
+        }
+
+        // Own MS with the register values MS0 had, then switch the source
+        uint8_t msBaseaddr = SI5351_REGISTER_42_MULTISYNTH0_PARAMETERS_1 + 8*output;
+        result |= si5351_writeMasked(msBaseaddr, setup->ms, si5351_shadowDiff(msBaseaddr, setup->ms));
+        result |= si5351_writeChanged(SI5351_REGISTER_165_CLK0_INITIAL_PHASE_OFFSET + output, setup->phaseOffset);
+
+        uint8_t clkControl = 0x0C | setup->driveStrength;
+        if(setup->pll == SI5351_PLL_B) {
+            clkControl |= (1 << 5);
+        }
+        if(setup->intMode) {
+            clkControl |= (1 << 6);
+        }
+        result |= si5351_writeChanged(SI5351_REGISTER_16_CLK0_CONTROL + output, clkControl);
+        setup->sharesMS0 = 0;
+    }
+    return result;
+}
+
 /**
  * @brief Calculates PLL, MS and RDiv settings for given Fclk in [8_000, 160_000_000] range.
  * The actual frequency will differ less than 6 Hz from given Fclk, assuming `correction` is right.
@@ -378,6 +496,216 @@ void si5351_CalcIQ(int32_t Fclk, si5351PLLConfig_t* pll_conf, si5351OutputConfig
     pll_conf->denom = Fxtal / 24; // denom can't exceed 0xFFFFF
 }
 
+/**
+ * @brief Selects the chip variant. Si5351A is assumed by default.
+ * 
+ * @param variant 
+ */
+void si5351_SetVariant(si5351Variant_t variant) {
+    si5351Variant = variant;
+}
+
+/**
+ * @brief Calculates PLL, MS and RDiv settings for given Fclk in [8_000, 160_000_000] range
+ * suitable for VCXO mode. MS runs in integer mode and PLL is fractional with denom = 10^6,
+ * the PLL resolution is 25 Hz thus the actual frequency will differ less than 25/MS Hz
+ * (less than 7 Hz) from given Fclk, assuming `correction` is right.
+ * 
+ * @param Fclk 
+ * @param pll_conf 
+ * @param out_conf 
+ */
+void si5351_CalcVCXO(int32_t Fclk, si5351PLLConfig_t* pll_conf, si5351OutputConfig_t* out_conf) {
+    if(Fclk < 8000) Fclk = 8000;
+    else if(Fclk > 160000000) Fclk = 160000000;
+
+    out_conf->allowIntegerMode = 1;
+
+    if(Fclk < 1000000) {
+        Fclk *= 64;
+        out_conf->rdiv = SI5351_R_DIV_64;
+    } else {
+        out_conf->rdiv = SI5351_R_DIV_1;
+    }
+
+    // Apply correction, _after_ determining rdiv.
+    Fclk = Fclk - ((Fclk/1000000)*si5351Correction)/100;
+
+    const int32_t Fxtal = 25000000;
+    int32_t x;
+
+    if(Fclk < 81000000) {
+        // PLL runs in (819, 900] MHz range
+        x = 900000000 / Fclk;
+    } else if(Fclk >= 150000000) {
+        x = 4;
+    } else if(Fclk >= 100000000) {
+        x = 6;
+    } else {
+        x = 8;
+    }
+
+    // AN619: in VCXO mode PLL B denom should be exactly 10^6, so num is
+    // counted in Fxtal / 10^6 = 25 Hz steps.
+    int32_t Fpll = x * Fclk;
+    pll_conf->mult = Fpll / Fxtal;
+    pll_conf->num = (Fpll % Fxtal) / 25;
+    pll_conf->denom = 1000000;
+    out_conf->div = x;
+    out_conf->num = 0;
+    out_conf->denom = 1;
+}
+
+/**
+ * @brief Programs PLL B and the VCXO pull range. Si5351B only.
+ * Resets PLL B only, outputs on PLL A keep running. Setup the output first.
+ * 
+ * @param aprPpm absolute pull range in ppm, [30, 240]. The frequency changes by
+ * ±aprPpm when VC goes from VDD/2 to VDD or 0.
+ * @param conf PLL B settings, see si5351_CalcVCXO()
+ * @return int Returns 0 on success, != 0 otherwise.
+ */
+int si5351_SetupVCXO(uint16_t aprPpm, si5351PLLConfig_t* conf) {
+    if(si5351Variant != SI5351_VARIANT_B) {
+        return 1;
+    }
+
+    if((aprPpm < 30) || (aprPpm > 240)) {
+        return 2;
+    }
+
+    if(conf->denom != 1000000) {
+        return 3;
+    }
+
+    uint8_t regs[8];
+    si5351_encodePLL(conf, regs);
+    si5351_writeBurst(34, regs, 8); // PLL B registers 34..41
+    si5351_write(SI5351_REGISTER_177_PLL_RESET, (1<<7));
+    si5351PLLSetup[SI5351_PLL_B] = *conf;
+    si5351PLLSetupValid[SI5351_PLL_B] = 1;
+
+    // AN619: VCXO_Param = 1.03 * (128a + b/10^6) * APR, rounded
+    uint64_t param = 103ULL * aprPpm * (128ULL * conf->mult * 1000000ULL + conf->num);
+    param = (param + 50000000ULL) / 100000000ULL;
+
+    si5351_write(SI5351_REGISTER_162_VCXO_PARAMETERS_LOW, param & 0xFF);
+    si5351_write(SI5351_REGISTER_163_VCXO_PARAMETERS_MID, (param >> 8) & 0xFF);
+    si5351_write(SI5351_REGISTER_164_VCXO_PARAMETERS_HIGH, (param >> 16) & 0x3F);
+
+    si5351VCXOApr = aprPpm;
+    si5351VCXOOffset = 0;
+    si5351_publish();
+    return 0;
+}
+
+/**
+ * @brief Registers the procedure that drives the VC pin.
+ * 
+ * @param output called with VC voltage in millivolts
+ * @param vddMillivolts Si5351B VDD, VC = VDD/2 gives the nominal frequency
+ */
+void si5351_SetVCOutput(si5351VCOutput_t output, uint16_t vddMillivolts) {
+    si5351VCOutput = output;
+    si5351VddMillivolts = vddMillivolts;
+}
+
+/**
+ * @brief Pulls PLL B by given offset from the nominal frequency. No I2C traffic is involved.
+ * The offset is clamped to the pull range set by si5351_SetupVCXO().
+ * 
+ * @param offsetPpb frequency offset in parts per billion, positive values increase the frequency
+ * @return int Returns 0 on success, 1 if VCXO or VC output is not set up, 2 if the offset was clamped.
+ */
+int si5351_SetVCXOOffset(int32_t offsetPpb) {
+    if((si5351VCOutput == NULL) || (si5351VCXOApr == 0)) {
+        return 1;
+    }
+
+    int result = 0;
+    int32_t range = (int32_t)si5351VCXOApr * 1000;
+    if(offsetPpb > range) {
+        offsetPpb = range;
+        result = 2;
+    } else if(offsetPpb < -range) {
+        offsetPpb = -range;
+        result = 2;
+    }
+
+    // Kv is positive, APR is reached at the rails.
+    int32_t half = si5351VddMillivolts / 2;
+    int32_t millivolts = half + (int32_t)(((int64_t)offsetPpb * half) / range);
+    si5351VCOutput((uint16_t)millivolts);
+
+    si5351VCXOOffset = offsetPpb;
+    si5351_publish();
+    return result;
+}
+
+/**
+ * @brief Tunes given output driven by PLL B to Fclk. Steps within the pull range
+ * around the last coarse frequency with the same drive strength only change the
+ * VC voltage, other steps reprogram PLL B and the output and set VC to cover the
+ * remaining error. Si5351B only. PLL B pulls every output it drives, so only one output may run
+ * from PLL B: move other outputs to PLL A before tuning a new one.
+ * 
+ * @param output 
+ * @param Fclk 
+ * @param driveStrength 
+ * @return int Returns 0 on success, 1 if it's not Si5351B or there's no such output,
+ * 4 if another output runs from PLL B. Nothing is written on errors.
+ */
+int si5351_TuneVCXO(uint8_t output, int32_t Fclk, si5351DriveStrength_t driveStrength) {
+    if((si5351Variant != SI5351_VARIANT_B) || (output > 2)) {
+        return 1;
+    }
+
+    for(uint8_t i = 0; i < 3; i++) {
+        if((i != output) && si5351OutputSetup[i].valid && (si5351OutputSetup[i].pll == SI5351_PLL_B)) {
+            return 4;
+        }
+    }
+
+    if((si5351VCXOCenter != 0) && (si5351VCXOOutput == output) && (si5351VCOutput != NULL) &&
+       (si5351OutputSetup[output].driveStrength == driveStrength)) {
+        int64_t offsetPpb = ((int64_t)(Fclk - si5351VCXOCenter) * 1000000000LL) / si5351VCXOCenter;
+        int64_t fineRange = (int64_t)si5351VCXOApr * 10 * SI5351_VCXO_FINE_PERCENT;
+        if((offsetPpb >= -fineRange) && (offsetPpb <= fineRange)) {
+            return si5351_SetVCXOOffset((int32_t)offsetPpb);
+        }
+    }
+
+    si5351PLLConfig_t pll_conf;
+    si5351OutputConfig_t out_conf;
+    uint16_t aprPpm = (si5351VCXOApr != 0) ? si5351VCXOApr : 30;
+
+    si5351VCXOCenter = 0;
+    si5351_CalcVCXO(Fclk, &pll_conf, &out_conf);
+    int err = si5351_SetupOutput(output, SI5351_PLL_B, driveStrength, &out_conf, 0);
+    if(err != 0) {
+        return err;
+    }
+    err = si5351_SetupVCXO(aprPpm, &pll_conf);
+    if(err != 0) {
+        return err;
+    }
+
+    // Offsets are measured from what PLL B and MS actually give at VC = VDD/2,
+    // not from the request, which may be clamped or off by up to 25/MS Hz.
+    si5351VCXOCenter = si5351_outputFreq(&pll_conf, &out_conf);
+    si5351VCXOOutput = output;
+    if(si5351VCOutput != NULL) {
+        // Requests out of the chip range are clamped by si5351_CalcVCXO(), keep VC at VDD/2 for them
+        int64_t offsetPpb = ((int64_t)(Fclk - si5351VCXOCenter) * 1000000000LL) / si5351VCXOCenter;
+        int64_t fineRange = (int64_t)si5351VCXOApr * 10 * SI5351_VCXO_FINE_PERCENT;
+        if((offsetPpb < -fineRange) || (offsetPpb > fineRange)) {
+            offsetPpb = 0;
+        }
+        si5351_SetVCXOOffset((int32_t)offsetPpb);
+    }
+    return 0;
+}
+
 /**
  * @brief Setup CLK0 for given frequency and drive strength. Use PLLA.
  * 
@@ -418,26 +746,503 @@ void si5351_SetupCLK2(int32_t Fclk, si5351DriveStrength_t driveStrength) {
  */
 void si5351_EnableOutputs(uint8_t enabled) {
     si5351_write(SI5351_REGISTER_3_OUTPUT_ENABLE_CONTROL, ~enabled);
+
+    si5351Enabled = enabled;
+    si5351_publish();
+}
+
+/**
+ * @brief Recovers the I2C bus. Clocks a stuck slave free and generates STOP only when
+ * SDA or SCL is held low, then restarts the controller. The registers are written back
+ * from the shadow copy only if the chip lost them (it was reset). Called automatically
+ * when a write fails twice in a row.
+ * 
+ * @return int Returns 0 on success, 1 if SDA or SCL is still held low, 2 if the replay failed.
+ */
+int si5351_RecoverBus(void) {
+    uint8_t sda = (si5351I2cSda == 0 && si5351I2cScl == 0) ? SDA : si5351I2cSda;
+    uint8_t scl = (si5351I2cSda == 0 && si5351I2cScl == 0) ? SCL : si5351I2cScl;
+    uint32_t start = micros();
+    uint32_t stageStart = start;
+    uint32_t now;
+    int result = 0;
+
+    memset(si5351BusStats.stageMicros, 0, sizeof(si5351BusStats.stageMicros));
+    si5351BusStats.lastClockPulses = 0;
+
+    // Detect: release the controller and look at the lines
+    Wire.end();
+    pinMode(sda, INPUT_PULLUP);
+    pinMode(scl, OUTPUT_OPEN_DRAIN);
+    digitalWrite(scl, HIGH);
+    uint8_t sclFree = si5351_waitSCL(scl);
+    uint8_t stuck = !sclFree || (digitalRead(sda) == LOW);
+    now = micros();
+    si5351BusStats.stageMicros[SI5351_RECOVERY_DETECT] = now - stageStart;
+    stageStart = now;
+
+    if(stuck) {
+        si5351BusStats.stuckBus++;
+
+        // Unstick: a slave holding SDA low is in the middle of a byte. Clock it out,
+        // SDA stays high on the ACK clock (NACK), so the slave releases the bus.
+        uint8_t pulses = 0;
+        while(sclFree && (digitalRead(sda) == LOW) && (pulses < SI5351_RECOVERY_CLOCKS)) {
+            digitalWrite(scl, LOW);
+            delayMicroseconds(SI5351_RECOVERY_HALF_PERIOD_US);
+            digitalWrite(scl, HIGH);
+            sclFree = si5351_waitSCL(scl);
+            delayMicroseconds(SI5351_RECOVERY_HALF_PERIOD_US);
+            pulses++;
+        }
+        si5351BusStats.lastClockPulses = pulses;
+        now = micros();
+        si5351BusStats.stageMicros[SI5351_RECOVERY_UNSTICK] = now - stageStart;
+        stageStart = now;
+
+        // Stop: SCL is high, SDA goes low (START) and back high (STOP). Slaves reset
+        // on START in any state, so this works even if SDA was released in the ACK slot.
+        if(sclFree && (digitalRead(sda) == HIGH)) {
+            pinMode(sda, OUTPUT_OPEN_DRAIN);
+            digitalWrite(sda, LOW);
+            delayMicroseconds(SI5351_RECOVERY_HALF_PERIOD_US);
+            digitalWrite(sda, HIGH);
+            delayMicroseconds(SI5351_RECOVERY_HALF_PERIOD_US);
+            pinMode(sda, INPUT_PULLUP);
+        }
+        if(!sclFree || (digitalRead(sda) == LOW)) {
+            result = 1;
+        }
+        now = micros();
+        si5351BusStats.stageMicros[SI5351_RECOVERY_STOP] = now - stageStart;
+        stageStart = now;
+    }
+
+    // Reinit: hand the pins back to the controller
+    si5351_beginWire();
+    now = micros();
+    si5351BusStats.stageMicros[SI5351_RECOVERY_REINIT] = now - stageStart;
+    stageStart = now;
+
+    // Replay: only if the chip was reset, this disables outputs and resets the PLLs.
+    // Stops at the first failure so the stage is bounded by one Wire timeout.
+    if((result == 0) && si5351_chipLostState()) {
+        si5351BusStats.replays++;
+        if(si5351_replay() != 0) {
+            result = 2;
+        }
+        now = micros();
+        si5351BusStats.stageMicros[SI5351_RECOVERY_REPLAY] = now - stageStart;
+    }
+
+    now = micros();
+    si5351BusStats.lastRecoveryMicros = now - start;
+    if(si5351BusStats.lastRecoveryMicros > si5351BusStats.maxRecoveryMicros) {
+        si5351BusStats.maxRecoveryMicros = si5351BusStats.lastRecoveryMicros;
+    }
+    if(result == 0) {
+        si5351BusStats.recoveries++;
+    } else {
+        si5351BusStats.failedRecoveries++;
+    }
+
+    si5351_publish();
+    return result;
 }
 
 /**
- * @brief Writes data to the specified register
+ * @brief Checks if the chip lost the configuration, i.e. it's still initializing
+ * after a reset or the registers that are never at power-up values after
+ * si5351_Init() differ from the shadow copy.
+ * 
+ * @return uint8_t Returns 1 if the registers should be written back, 0 otherwise.
+ */
+uint8_t si5351_chipLostState(void) {
+    uint8_t status;
+    if(si5351_read(SI5351_REGISTER_0_DEVICE_STATUS, &status, 1) != 0) {
+        return 1;
+    }
+    if(status & (1<<7)) {
+        // SYS_INIT
+        return 1;
+    }
+
+    const uint8_t regs[] = {
+        SI5351_REGISTER_3_OUTPUT_ENABLE_CONTROL,
+        SI5351_REGISTER_16_CLK0_CONTROL,
+        SI5351_REGISTER_17_CLK1_CONTROL,
+        SI5351_REGISTER_18_CLK2_CONTROL,
+    };
+    for(uint8_t i = 0; i < sizeof(regs); i++) {
+        uint8_t data;
+        uint8_t pending = (uint8_t)(regs[i] - si5351PendingReg) < si5351PendingLen;
+        if(!si5351_shadowValid(regs[i]) || pending) {
+            continue;
+        }
+        if((si5351_read(regs[i], &data, 1) != 0) || (data != si5351Shadow[regs[i]])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns bus error and recovery counters.
+ * 
+ * @param stats 
+ */
+void si5351_GetBusStats(si5351BusStats_t* stats) {
+    *stats = si5351BusStats;
+}
+
+/**
+ * @brief Copies the last published configuration. Never blocks, safe to call from any task.
+ * 
+ * @param snapshot 
+ */
+void si5351_GetSnapshot(si5351Snapshot_t* snapshot) {
+    uint32_t words[SI5351_SNAPSHOT_WORDS];
+    uint32_t seq;
+    do {
+        seq = si5351SnapshotSeq.load(std::memory_order_acquire);
+        for(size_t i = 0; i < SI5351_SNAPSHOT_WORDS; i++) {
+            words[i] = si5351Snapshots[seq & 1][i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while(si5351SnapshotSeq.load(std::memory_order_relaxed) != seq);
+    memcpy(snapshot, words, sizeof(si5351Snapshot_t));
+}
+
+/**
+ * @brief Publishes the current configuration for si5351_GetSnapshot(). Single writer,
+ * called by every procedure that changes the configuration.
+ */
+void si5351_publish(void) {
+    // Published by si5351_EndCommit() once the chip has it
+    if(si5351Staging) {
+        return;
+    }
+
+    si5351Snapshot_t snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+
+    for(int i = 0; i < 3; i++) {
+        si5351OutputSetup_t* setup = &si5351OutputSetup[i];
+        si5351OutputState_t* state = &snapshot.outputs[i];
+        state->enabled = (si5351Enabled >> i) & 1;
+        if(!setup->valid) {
+            continue;
+        }
+        state->pll = setup->pll;
+        state->driveStrength = setup->driveStrength;
+        state->phaseOffset = setup->phaseOffset;
+        state->sharesMS0 = setup->sharesMS0;
+        if(si5351PLLSetupValid[setup->pll]) {
+            state->freq = si5351_outputFreq(&si5351PLLSetup[setup->pll], &setup->conf);
+        }
+    }
+
+    si5351OutputConfig_t unity = { 1, 1, 0, 1, SI5351_R_DIV_1 };
+    for(int i = 0; i < 2; i++) {
+        if(si5351PLLSetupValid[i]) {
+            snapshot.pllFreq[i] = si5351_outputFreq(&si5351PLLSetup[i], &unity);
+        }
+    }
+
+    snapshot.vcxoOffsetPpb = si5351VCXOOffset;
+    snapshot.transfers = si5351Transfers;
+    snapshot.bytes = si5351Bytes;
+    snapshot.pllResets = si5351PLLResets;
+    snapshot.busErrors = si5351BusStats.busErrors;
+    snapshot.recoveries = si5351BusStats.recoveries;
+
+    uint32_t seq = si5351SnapshotSeq.load(std::memory_order_relaxed);
+    snapshot.sequence = seq / 2 + 1;
+
+    uint32_t words[SI5351_SNAPSHOT_WORDS] = { 0 };
+    memcpy(words, &snapshot, sizeof(si5351Snapshot_t));
+
+    // Readers move to the second copy, update the first one
+    si5351SnapshotSeq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for(size_t i = 0; i < SI5351_SNAPSHOT_WORDS; i++) {
+        si5351Snapshots[0][i].store(words[i], std::memory_order_relaxed);
+    }
+
+    // Readers move back to the first copy, update the second one
+    si5351SnapshotSeq.store(seq + 2, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_release);
+    for(size_t i = 0; i < SI5351_SNAPSHOT_WORDS; i++) {
+        si5351Snapshots[1][i].store(words[i], std::memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Copies the configuration set up so far
+ * 
+ * @param state 
+ */
+void si5351_saveState(si5351State_t* state) {
+    memcpy(state->shadow, si5351Shadow, sizeof(state->shadow));
+    memcpy(state->shadowValid, si5351ShadowValid, sizeof(state->shadowValid));
+    memcpy(state->pllSetup, si5351PLLSetup, sizeof(state->pllSetup));
+    memcpy(state->pllSetupValid, si5351PLLSetupValid, sizeof(state->pllSetupValid));
+    memcpy(state->outputSetup, si5351OutputSetup, sizeof(state->outputSetup));
+    state->enabled = si5351Enabled;
+    state->vcxoOffset = si5351VCXOOffset;
+    state->vcxoCenter = si5351VCXOCenter;
+    state->vcxoApr = si5351VCXOApr;
+    state->vcxoOutput = si5351VCXOOutput;
+}
+
+/**
+ * @brief Goes back to a configuration copied by si5351_saveState(), nothing is
+ * written to the chip
+ * 
+ * @param state 
+ */
+void si5351_restoreState(const si5351State_t* state) {
+    memcpy(si5351Shadow, state->shadow, sizeof(state->shadow));
+    memcpy(si5351ShadowValid, state->shadowValid, sizeof(state->shadowValid));
+    memcpy(si5351PLLSetup, state->pllSetup, sizeof(state->pllSetup));
+    memcpy(si5351PLLSetupValid, state->pllSetupValid, sizeof(state->pllSetupValid));
+    memcpy(si5351OutputSetup, state->outputSetup, sizeof(state->outputSetup));
+    si5351Enabled = state->enabled;
+    si5351VCXOOffset = state->vcxoOffset;
+    si5351VCXOCenter = state->vcxoCenter;
+    si5351VCXOApr = state->vcxoApr;
+    si5351VCXOOutput = state->vcxoOutput;
+}
+
+/**
+ * @brief Derives the configuration from the shadow registers, e.g. after they were
+ * loaded from storage. Powered down outputs are not set up.
+ */
+void si5351_adoptShadow(void) {
+    si5351RDiv_t rdiv;
+    for(int pll = 0; pll < 2; pll++) {
+        uint8_t base = (pll == SI5351_PLL_A) ? 26 : 34;
+        si5351PLLSetupValid[pll] = si5351_shadowValid(base) && si5351_shadowValid(base + 7);
+        if(si5351PLLSetupValid[pll]) {
+            si5351_decodeBulk(&si5351Shadow[base], &si5351PLLSetup[pll].mult, &si5351PLLSetup[pll].num, &si5351PLLSetup[pll].denom, &rdiv);
+        }
+    }
+
+    for(int i = 0; i < 3; i++) {
+        si5351OutputSetup_t* setup = &si5351OutputSetup[i];
+        uint8_t control = si5351Shadow[SI5351_REGISTER_16_CLK0_CONTROL + i];
+        uint8_t own = SI5351_REGISTER_42_MULTISYNTH0_PARAMETERS_1 + 8*i;
+        memset(setup, 0, sizeof(*setup));
+        if(!si5351_shadowValid(SI5351_REGISTER_16_CLK0_CONTROL + i) || (control & 0x80) || !si5351_shadowValid(own + 2)) {
+            continue;
+        }
+        // Source 0b10 is MS0, the R divider is always the output's own
+        setup->sharesMS0 = (i > 0) && (((control >> 2) & 0x3) == 0x2);
+        uint8_t ms = setup->sharesMS0 ? (uint8_t)SI5351_REGISTER_42_MULTISYNTH0_PARAMETERS_1 : own;
+        if(!si5351_shadowValid(ms) || !si5351_shadowValid(ms + 7)) {
+            continue;
+        }
+        si5351_decodeBulk(&si5351Shadow[ms], &setup->conf.div, &setup->conf.num, &setup->conf.denom, &rdiv);
+        setup->conf.rdiv = (si5351RDiv_t)((si5351Shadow[own + 2] >> 4) & 0x7);
+        setup->conf.allowIntegerMode = (control >> 6) & 1;
+        memcpy(setup->ms, &si5351Shadow[ms], sizeof(setup->ms));
+        setup->ms[2] = (setup->ms[2] & 0x8F) | (si5351Shadow[own + 2] & 0x70);
+        setup->intMode = (control >> 6) & 1;
+        setup->pll = (control & (1 << 5)) ? SI5351_PLL_B : SI5351_PLL_A;
+        setup->driveStrength = (si5351DriveStrength_t)(control & 0x3);
+        setup->phaseOffset = si5351Shadow[SI5351_REGISTER_165_CLK0_INITIAL_PHASE_OFFSET + i];
+        setup->valid = 1;
+    }
+
+    if(si5351_shadowValid(SI5351_REGISTER_3_OUTPUT_ENABLE_CONTROL)) {
+        si5351Enabled = ~si5351Shadow[SI5351_REGISTER_3_OUTPUT_ENABLE_CONTROL];
+    }
+}
+
+/**
+ * @brief Calculates the output frequency for given PLL and MS settings, `correction` is
+ * taken into account.
+ * 
+ * @param pll 
+ * @param out 
+ * @return uint32_t frequency in Hz
+ */
+uint32_t si5351_outputFreq(si5351PLLConfig_t* pll, si5351OutputConfig_t* out) {
+    const int64_t FxtalMilliHz = 25000000000LL;
+
+    // Fpll = Fxtal * (a + b/c), Fclk = Fpll / (x + y/z) / rdiv
+    int64_t FpllMilliHz = FxtalMilliHz * ((int64_t)pll->mult * pll->denom + pll->num) / pll->denom;
+    int64_t FclkMilliHz = FpllMilliHz * out->denom / ((int64_t)out->div * out->denom + out->num);
+    FclkMilliHz >>= out->rdiv;
+
+    // si5351_Calc() lowers Fclk by `correction`, the crystal makes it up
+    FclkMilliHz += FclkMilliHz * si5351Correction / 100000000LL;
+    return (uint32_t)((FclkMilliHz + 500) / 1000);
+}
+
+/**
+ * @brief Starts the I2C controller on the pins passed to si5351_Init()
+ */
+void si5351_beginWire(void) {
+    if(si5351I2cSda == 0 && si5351I2cScl == 0) {
+        // using standard ESP32 I2C pins (SDA: 21, SCL: 22)
+        Wire.begin();
+    }
+    else {
+        Wire.begin(si5351I2cSda, si5351I2cScl, I2C_FREQUENCY);
+    }
+}
+
+/**
+ * @brief Waits until SCL is released, slaves may stretch the clock.
+ * 
+ * @param scl SCL pin
+ * @return uint8_t Returns 1 if SCL is high, 0 if it's still held low after SI5351_RECOVERY_STRETCH_US.
+ */
+uint8_t si5351_waitSCL(uint8_t scl) {
+    uint32_t start = micros();
+    while(digitalRead(scl) == LOW) {
+        if((uint32_t)(micros() - start) > SI5351_RECOVERY_STRETCH_US) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Writes all shadowed registers to the chip. Outputs are disabled meanwhile
+ * and PLLs are reset after their parameters are written.
+ * 
+ * @return uint8_t Returns 0 on success, != 0 otherwise.
+ */
+uint8_t si5351_replay(void) {
+    uint8_t off = 0xFF;
+    if(si5351_transmit(SI5351_REGISTER_3_OUTPUT_ENABLE_CONTROL, &off, 1) != 0) {
+        return 1;
+    }
+
+    uint8_t pllWritten = 0;
+    for(int reg = 0; reg < 256; reg++) {
+        if((reg == SI5351_REGISTER_3_OUTPUT_ENABLE_CONTROL) || !si5351_shadowValid(reg)) {
+            continue;
+        }
+        if(si5351_transmit(reg, &si5351Shadow[reg], 1) != 0) {
+            return 1;
+        }
+        if((reg >= 26) && (reg <= 41)) {
+            pllWritten = 1;
+        }
+    }
+
+    if(pllWritten) {
+        uint8_t reset = (1<<7) | (1<<5);
+        if(si5351_transmit(SI5351_REGISTER_177_PLL_RESET, &reset, 1) != 0) {
+            return 1;
+        }
+    }
+
+    if(si5351_shadowValid(SI5351_REGISTER_3_OUTPUT_ENABLE_CONTROL)) {
+        return si5351_transmit(SI5351_REGISTER_3_OUTPUT_ENABLE_CONTROL, &si5351Shadow[SI5351_REGISTER_3_OUTPUT_ENABLE_CONTROL], 1);
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns 1 if the register was written since si5351_Init()
+ * 
+ * @param reg 
+ * @return uint8_t 
+ */
+uint8_t si5351_shadowValid(uint8_t reg) {
+    return (si5351ShadowValid[reg >> 3] >> (reg & 7)) & 1;
+}
+
+/**
+ * @brief Writes data to the specified register. On failure recovers the bus,
+ * see si5351_RecoverBus().
  * 
  * @param reg register address
  * @param data 
- * @return uint8_t 
+ * @return uint8_t Returns 0 on success, 1 if the bus couldn't be recovered.
  */
 uint8_t si5351_write(uint8_t reg, uint8_t data)
 {
-    Wire.beginTransmission(SI5351_ADDRESS);
-    
-    Wire.write(reg); // register address
-    Wire.write(data);
-    
-    uint8_t error = Wire.endTransmission(true);
+    return si5351_writeBurst(reg, &data, 1);
+}
+
+/**
+ * @brief Writes data to the specified register unless it's known to have this value already.
+ * 
+ * @param reg 
+ * @param data 
+ * @return uint8_t Returns 0 on success, 1 if the bus couldn't be recovered.
+ */
+uint8_t si5351_writeChanged(uint8_t reg, uint8_t data)
+{
+    if(si5351_shadowValid(reg) && (si5351Shadow[reg] == data)) {
+        return 0;
+    }
+    return si5351_write(reg, data);
+}
+
+/**
+ * @brief Writes len registers starting from the specified one in one transfer.
+ * On failure recovers the bus, see si5351_RecoverBus().
+ * 
+ * @param reg first register address
+ * @param data 
+ * @param len 
+ * @return uint8_t Returns 0 on success, 1 if the bus couldn't be recovered.
+ */
+uint8_t si5351_writeBurst(uint8_t reg, const uint8_t* data, uint8_t len)
+{
+    for(uint8_t i = 0; i < len; i++) {
+        uint8_t r = reg + i;
+        // PLL reset is self-clearing, it's not a part of the chip state
+        if(r == SI5351_REGISTER_177_PLL_RESET) {
+            si5351PLLResets += !si5351Staging;
+        } else {
+            si5351Shadow[r] = data[i];
+            si5351ShadowValid[r >> 3] |= (1 << (r & 7));
+        }
+    }
+
+    // Sent by si5351_EndCommit()
+    if(si5351Staging) {
+        return si5351_stage(reg, data, len);
+    }
 
     // success
-    if(error == 0)
+    if(si5351_transmit(reg, data, len) == 0)
+    {
+        return 0;
+    }
+
+    si5351BusStats.busErrors++;
+
+    // Transient error, e.g. a single NACK
+    if(si5351_transmit(reg, data, len) == 0)
+    {
+        return 0;
+    }
+
+    // The replay, if the chip needs one, writes these registers too
+    si5351PendingReg = reg;
+    si5351PendingLen = len;
+    int recovered = si5351_RecoverBus();
+    si5351PendingLen = 0;
+    if(recovered != 0)
+    {
+        return 1;
+    }
+    if(si5351_transmit(reg, data, len) == 0)
+    {
+        return 0;
+    }
+
+    // Still failing, the chip state is unknown
+    si5351BusStats.replays++;
+    if(si5351_replay() == 0)
     {
         return 0;
     }
@@ -446,22 +1251,299 @@ uint8_t si5351_write(uint8_t reg, uint8_t data)
 }
 
 /**
- * @brief Common code for _SetupPLL and _SetupOutput
+ * @brief Writes the registers selected by mask, bit i selects baseaddr+i.
+ * Neighbouring runs are merged when the gap costs no more than a new transfer.
  * 
  * @param baseaddr 
+ * @param data data[i] goes to baseaddr+i
+ * @param mask 
+ * @return uint8_t Returns 0 on success, != 0 otherwise.
+ */
+uint8_t si5351_writeMasked(uint8_t baseaddr, const uint8_t* data, uint8_t mask)
+{
+    uint8_t result = 0;
+    int i = 0;
+    while(i < 8) {
+        if(!(mask & (1 << i))) {
+            i++;
+            continue;
+        }
+        int end = i;
+        for(int j = i + 1; j < 8; j++) {
+            if((mask & (1 << j)) && (j - end <= 3)) {
+                end = j;
+            }
+        }
+        result |= si5351_writeBurst(baseaddr + i, data + i, end - i + 1);
+        i = end + 1;
+    }
+    return result;
+}
+
+/**
+ * @brief Returns bit reg of a 256-bit register mask
+ * 
+ * @param mask 
+ * @param reg 
+ * @return uint8_t 
+ */
+uint8_t si5351_maskBit(const uint8_t* mask, int reg)
+{
+    return (mask[reg >> 3] >> (reg & 7)) & 1;
+}
+
+/**
+ * @brief Writes the registers selected by a 256-bit mask from the shadow copy in runs.
+ * Like in si5351_writeMasked() a gap of up to 2 registers goes along when it's cheaper
+ * than a new transfer, if the gap registers are known.
+ * 
+ * @param mask 
+ * @param write 0 to count the bytes only
+ * @param failed set to 1 if a write failed, can be NULL if write is 0
+ * @return uint32_t bus bytes, 2 (device and register address) per transfer plus the data
+ */
+uint32_t si5351_writeRuns(const uint8_t* mask, uint8_t write, uint8_t* failed)
+{
+    uint32_t bytes = 0;
+    int i = 0;
+    while(i < 256) {
+        if(!si5351_maskBit(mask, i)) {
+            i++;
+            continue;
+        }
+        int end = i;
+        for(int j = i + 1; (j < 256) && (j - end <= 3); j++) {
+            if(si5351_maskBit(mask, j)) {
+                // the gap goes along, so it has to be known and not the PLL reset
+                uint8_t gapValid = 1;
+                for(int g = end + 1; g < j; g++) {
+                    if(!si5351_shadowValid(g) || (g == SI5351_REGISTER_177_PLL_RESET)) {
+                        gapValid = 0;
+                    }
+                }
+                if(!gapValid) {
+                    break;
+                }
+                end = j;
+            }
+        }
+        uint8_t len = end - i + 1;
+        bytes += 2 + len;
+        if(write && (si5351_writeBurst(i, &si5351Shadow[i], len) != 0)) {
+            *failed = 1;
+        }
+        i = end + 1;
+    }
+    return bytes;
+}
+
+/**
+ * @brief Bus bytes si5351_writeMasked() needs for given mask, 2 bytes
+ * (device and register address) per transfer plus the data.
+ * 
+ * @param mask 
+ * @return uint8_t 
+ */
+uint8_t si5351_maskBytes(uint8_t mask)
+{
+    uint8_t bytes = 0;
+    int i = 0;
+    while(i < 8) {
+        if(!(mask & (1 << i))) {
+            i++;
+            continue;
+        }
+        int end = i;
+        for(int j = i + 1; j < 8; j++) {
+            if((mask & (1 << j)) && (j - end <= 3)) {
+                end = j;
+            }
+        }
+        bytes += 2 + (end - i + 1);
+        i = end + 1;
+    }
+    return bytes;
+}
+
+/**
+ * @brief Reads len registers starting from the specified one
+ * 
+ * @param reg register address
+ * @param data 
+ * @param len 
+ * @return uint8_t Returns 0 on success, != 0 otherwise.
+ */
+uint8_t si5351_read(uint8_t reg, uint8_t* data, uint8_t len)
+{
+    si5351Transfers++;
+    si5351Bytes += 2;
+
+    Wire.beginTransmission(SI5351_ADDRESS);
+    Wire.write(reg); // register address
+    if(Wire.endTransmission(false) != 0) {
+        return 1;
+    }
+
+    si5351Transfers++;
+    si5351Bytes += 1 + len;
+
+    if(Wire.requestFrom((uint8_t)SI5351_ADDRESS, len) != len) {
+        return 1;
+    }
+    for(uint8_t i = 0; i < len; i++) {
+        data[i] = Wire.read();
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes len bytes starting from the specified register in one transfer
+ * 
+ * @param reg register address
+ * @param data 
+ * @param len 
+ * @return uint8_t Returns the Wire.endTransmission() status, 0 on success.
+ */
+uint8_t si5351_transmit(uint8_t reg, const uint8_t* data, uint8_t len)
+{
+    si5351Transfers++;
+    si5351Bytes += 2 + len;
+
+    Wire.beginTransmission(SI5351_ADDRESS);
+    
+    Wire.write(reg); // register address
+    for(uint8_t i = 0; i < len; i++) {
+        Wire.write(data[i]);
+    }
+    
+    return Wire.endTransmission(true);
+}
+
+/**
+ * @brief Packs PLL or MS parameters into the layout of 8 consecutive registers
+ * 
  * @param P1 
  * @param P2 
  * @param P3 
  * @param divBy4 
  * @param rdiv 
+ * @param regs 8 bytes
+ */
+void si5351_encodeBulk(int32_t P1, int32_t P2, int32_t P3, uint8_t divBy4, si5351RDiv_t rdiv, uint8_t* regs) {
+    regs[0] = (P3 >> 8) & 0xFF;
+    regs[1] = P3 & 0xFF;
+    regs[2] = ((P1 >> 16) & 0x3) | ((divBy4 & 0x3) << 2) | ((rdiv & 0x7) << 4);
+    regs[3] = (P1 >> 8) & 0xFF;
+    regs[4] = P1 & 0xFF;
+    regs[5] = ((P3 >> 12) & 0xF0) | ((P2 >> 16) & 0xF);
+    regs[6] = (P2 >> 8) & 0xFF;
+    regs[7] = P2 & 0xFF;
+}
+
+/**
+ * @brief Inverse of si5351_encodeBulk(): a + b/c such as P1 + 512 + P2/P3 = 128 * (a + b/c).
+ * c is P3 if b is an integer, as it is for everything si5351_encodePLL() and
+ * si5351_encodeOutput() produce, and 128 * P3 otherwise, e.g. 2^20 for si5351_CalcFast()
+ * images. That doesn't fit P3, the result is for frequency calculations only: don't pass
+ * it to si5351_encodeOutput() or si5351_encodePLL(), keep the register values instead.
+ * 
+ * @param regs 8 bytes
+ * @param a 
+ * @param b 
+ * @param c 
+ * @param rdiv 
+ */
+void si5351_decodeBulk(const uint8_t* regs, int32_t* a, int32_t* b, int32_t* c, si5351RDiv_t* rdiv) {
+    *rdiv = (si5351RDiv_t)((regs[2] >> 4) & 0x7);
+    if(((regs[2] >> 2) & 0x3) == 0x3) {
+        // DIVBY4
+        *a = 4;
+        *b = 0;
+        *c = 1;
+        return;
+    }
+
+    int32_t P1 = ((int32_t)(regs[2] & 0x3) << 16) | ((int32_t)regs[3] << 8) | regs[4];
+    int32_t P2 = ((int32_t)(regs[5] & 0xF) << 16) | ((int32_t)regs[6] << 8) | regs[7];
+    int32_t P3 = ((int32_t)(regs[5] & 0xF0) << 12) | ((int32_t)regs[0] << 8) | regs[1];
+    int32_t n = ((P1 + 512) & 127) * P3 + P2;
+
+    *a = (P1 + 512) >> 7;
+    if((n & 127) == 0) {
+        *b = n >> 7;
+        *c = P3;
+    } else {
+        *b = n;
+        *c = 128 * P3;
+    }
+}
+
+/**
+ * @brief Finds the registers in [baseaddr, baseaddr+8) that differ from data
+ * or were never written.
+ * 
+ * @param baseaddr 
+ * @param data 
+ * @return uint8_t mask, bit i stands for baseaddr+i
+ */
+uint8_t si5351_shadowDiff(uint8_t baseaddr, const uint8_t* data) {
+    uint8_t mask = 0;
+    for(int i = 0; i < 8; i++) {
+        uint8_t reg = baseaddr + i;
+        if(!si5351_shadowValid(reg) || (si5351Shadow[reg] != data[i])) {
+            mask |= (1 << i);
+        }
+    }
+    return mask;
+}
+
+/**
+ * @brief Calculates PLL register values
+ * 
+ * @param conf 
+ * @param regs 8 bytes, the layout of registers 26..33 or 34..41
  */
-void si5351_writeBulk(uint8_t baseaddr, int32_t P1, int32_t P2, int32_t P3, uint8_t divBy4, si5351RDiv_t rdiv) {
-    si5351_write(baseaddr,   (P3 >> 8) & 0xFF);
-    si5351_write(baseaddr+1, P3 & 0xFF);
-    si5351_write(baseaddr+2, ((P1 >> 16) & 0x3) | ((divBy4 & 0x3) << 2) | ((rdiv & 0x7) << 4));
-    si5351_write(baseaddr+3, (P1 >> 8) & 0xFF);
-    si5351_write(baseaddr+4, P1 & 0xFF);
-    si5351_write(baseaddr+5, ((P3 >> 12) & 0xF0) | ((P2 >> 16) & 0xF));
-    si5351_write(baseaddr+6, (P2 >> 8) & 0xFF);
-    si5351_write(baseaddr+7, P2 & 0xFF);
+void si5351_encodePLL(si5351PLLConfig_t* conf, uint8_t* regs) {
+    int32_t P1, P2, P3;
+    int32_t mult = conf->mult;
+    int32_t num = conf->num;
+    int32_t denom = conf->denom;
+
+    P1 = 128 * mult + (128 * num)/denom - 512;
+    // P2 = 128 * num - denom * ((128 * num)/denom);
+    P2 = (128 * num) % denom;
+    P3 = denom;
+
+    si5351_encodeBulk(P1, P2, P3, 0, SI5351_R_DIV_1, regs);
+}
+
+/**
+ * @brief Calculates MS and RDiv register values
+ * 
+ * @param conf 
+ * @param regs 8 bytes, the layout of registers 42..49 etc
+ * @return uint8_t Returns 1 if the MS should run in integer mode, 0 otherwise.
+ */
+uint8_t si5351_encodeOutput(si5351OutputConfig_t* conf, uint8_t* regs) {
+    int32_t div = conf->div;
+    int32_t num = conf->num;
+    int32_t denom = conf->denom;
+    uint8_t divBy4 = 0;
+    int32_t P1, P2, P3;
+
+    if(div == 4) {
+        // special DIVBY4 case, see AN619 4.1.3
+        P1 = 0;
+        P2 = 0;
+        P3 = 1;
+        divBy4 = 0x3;
+    } else {
+        P1 = 128 * div + ((128 * num)/denom) - 512;
+        // P2 = 128 * num - denom * (128 * num)/denom;
+        P2 = (128 * num) % denom;
+        P3 = denom;
+    }
+
+    si5351_encodeBulk(P1, P2, P3, divBy4, conf->rdiv, regs);
+    return (conf->allowIntegerMode) && ((num == 0) || (div == 4));
 }
@@ -10,6 +10,12 @@ typedef enum {
     SI5351_PLL_B,
 } si5351PLL_t;
 
+typedef enum {
+    SI5351_VARIANT_A = 0, // crystal input
+    SI5351_VARIANT_B,     // crystal input, PLL B can be pulled by the VC pin (VCXO)
+    SI5351_VARIANT_C,     // crystal or CLKIN input
+} si5351Variant_t;
+
 typedef enum {
     SI5351_R_DIV_1   = 0,
     SI5351_R_DIV_2   = 1,
@@ -42,6 +48,135 @@ typedef struct {
     si5351RDiv_t rdiv;
 } si5351OutputConfig_t;
 
+typedef enum {
+    SI5351_RECOVERY_DETECT = 0, // release the controller, check SDA and SCL
+    SI5351_RECOVERY_UNSTICK,    // clock out the byte a slave is stuck in
+    SI5351_RECOVERY_STOP,       // generate STOP
+    SI5351_RECOVERY_REINIT,     // restart the I2C controller
+    SI5351_RECOVERY_REPLAY,     // write the shadow registers back
+    SI5351_RECOVERY_STAGES,
+} si5351RecoveryStage_t;
+
+typedef struct {
+    uint32_t busErrors;          // failed transfers
+    uint32_t stuckBus;           // recoveries that found SDA or SCL held low
+    uint32_t recoveries;         // successful recoveries
+    uint32_t failedRecoveries;
+    uint32_t replays;            // register write-backs after the chip lost its state
+    uint32_t lastRecoveryMicros;
+    uint32_t maxRecoveryMicros;
+    uint32_t stageMicros[SI5351_RECOVERY_STAGES]; // of the last recovery
+    uint8_t lastClockPulses;
+    uint32_t rollbacks;          // failed commits undone, see si5351_EndCommit()
+    uint32_t rollForwards;       // failed commits completed
+} si5351BusStats_t;
+
+typedef struct {
+    uint32_t freq;                          // Hz, 0 if the output is not set up
+    si5351PLL_t pll;
+    si5351DriveStrength_t driveStrength;
+    uint8_t phaseOffset;
+    uint8_t enabled;
+    uint8_t sharesMS0;                      // runs from MS0 of CLK0, see si5351_SetupOutput()
+} si5351OutputState_t;
+
+typedef struct {
+    uint32_t sequence;                      // incremented on every update
+    si5351OutputState_t outputs[3];
+    uint32_t pllFreq[2];                    // Hz, 0 if the PLL is not set up
+    int32_t vcxoOffsetPpb;                  // PLL B pull, see si5351_SetVCXOOffset()
+    uint32_t transfers;                     // I2C transfers since si5351_Init()
+    uint32_t bytes;                         // bytes on the bus, including address bytes
+    uint32_t pllResets;
+    uint32_t busErrors;
+    uint32_t recoveries;
+} si5351Snapshot_t;
+
+typedef struct {
+    uint8_t pll[8];                         // registers 26..33 or 34..41
+    uint8_t ms[8];                          // registers 42..49, 50..57 or 58..65
+    uint8_t intMode;                        // MS_INT bit of the CLK control register
+} si5351RegImage_t;
+
+typedef struct {
+    uint32_t num;                           // output frequency is Fclk * num / den
+    uint32_t den;
+} si5351Ratio_t;
+
+typedef enum {
+    SI5351_SWEEP_ANY_ORDER = 0,             // frequencies can be visited in any order
+    SI5351_SWEEP_MONOTONIC_SEGMENTS,        // segments keep their order, each one is visited
+                                            // ascending or descending
+} si5351SweepOrder_t;
+
+typedef struct {
+    uint16_t index;                         // position in the list passed to si5351_PlanSweep()
+    int32_t Fclk;
+    si5351PLLConfig_t pll_conf;
+    si5351OutputConfig_t out_conf;
+    si5351RegImage_t image;
+    uint8_t pllMask;                        // image.pll bytes that differ from the previous step
+    uint8_t msMask;                         // image.ms bytes that differ from the previous step
+    uint8_t controlChanged;                 // CLK control register has to be written
+    uint16_t bytes;                         // bus bytes of this step, including the PLL reset
+} si5351SweepStep_t;
+
+typedef enum {
+    SI5351_PRIORITY_URGENT = 0,             // e.g. keying
+    SI5351_PRIORITY_HIGH,                   // e.g. frequency hops with a deadline
+    SI5351_PRIORITY_NORMAL,                 // e.g. telemetry reads
+    SI5351_PRIORITY_LOW,                    // e.g. background verification and restore
+    SI5351_PRIORITIES,
+} si5351Priority_t;
+
+typedef enum {
+    SI5351_BUS_PRIORITY = 0,                // highest class first, preempts at burst boundaries
+    SI5351_BUS_FIFO,                        // submission order, every job runs to completion
+} si5351BusPolicy_t;
+
+#define SI5351_LATENCY_BUCKETS 20
+
+typedef struct {
+    uint32_t completed;                     // jobs
+    uint32_t maxMicros;                     // from si5351_Queue*() to the last burst
+    uint32_t histogram[SI5351_LATENCY_BUCKETS]; // bucket i: latency < 2^(i+1) us, the last one takes the rest
+} si5351ClassStats_t;
+
+typedef struct {
+    si5351ClassStats_t classes[SI5351_PRIORITIES];
+    uint32_t rejected;                      // queue was full
+    uint32_t preemptions;                   // steps taken while a started job waited
+    uint32_t readbackMismatches;            // registers that differ from the shadow copy
+    uint32_t failedBursts;
+} si5351SchedStats_t;
+
+/*
+ * Storage for the configuration journal, e.g. a flash partition. Erasing a sector
+ * sets all its bytes to 0xFF, writes only clear bits. The functions return 0 on success.
+ */
+typedef struct {
+    uint32_t sectorSize;                    // bytes, at least 512
+    uint8_t sectors;                        // at least 2
+    int (*read)(uint32_t addr, uint8_t* data, uint32_t len);
+    int (*write)(uint32_t addr, const uint8_t* data, uint32_t len);
+    int (*erase)(uint8_t sector);
+} si5351Storage_t;
+
+typedef struct {
+    uint32_t records;                       // deltas appended since si5351_LoadJournal()
+    uint32_t compactions;                   // snapshots written, one sector erase each
+    uint32_t bytesWritten;                  // to the storage
+    uint32_t replayRecords;                 // read by the last si5351_LoadJournal()
+    uint32_t replayMicros;                  // of the last si5351_LoadJournal(), including the restore
+    uint32_t restoreBytes;                  // bus bytes of the last restore
+} si5351JournalStats_t;
+
+/*
+ * Drives the VC pin of Si5351B. Called with the desired voltage in millivolts,
+ * implement it with a DAC channel, a filtered PWM output or an external DAC.
+ */
+typedef void (*si5351VCOutput_t)(uint16_t millivolts);
+
 /*
  * Basic interface allows to use only CLK0 and CLK2.
  * This interface uses separate PLLs for both CLK0 and CLK2 thus the frequencies
@@ -76,7 +211,150 @@ void si5351_Calc(int32_t Fclk, si5351PLLConfig_t* pll_conf, si5351OutputConfig_t
  */
 void si5351_CalcIQ(int32_t Fclk, si5351PLLConfig_t* pll_conf, si5351OutputConfig_t* out_conf);
 
+/*
+ * If CLK1 or CLK2 is set up with the same PLL, MS settings and phase offset as CLK0,
+ * it's routed from MS0 through the CLK control source select instead of programming
+ * its own MS: two registers are written instead of ten. Drive strengths can differ.
+ * When CLK0 is changed later, the outputs routed from MS0 get their own MS first and
+ * keep their frequency. The same applies to si5351_SetupImage().
+ */
 void si5351_SetupPLL(si5351PLL_t pll, si5351PLLConfig_t* conf);
 int si5351_SetupOutput(uint8_t output, si5351PLL_t pllSource, si5351DriveStrength_t driveStength, si5351OutputConfig_t* conf, uint8_t phaseOffset);
 
+/*
+ * VCXO interface, Si5351B only.
+ *
+ * On Si5351B PLL B can be pulled by the voltage on the VC pin by up to ±APR ppm,
+ * so small frequency changes don't need any I2C traffic. si5351_CalcVCXO() works
+ * like si5351_Calc() but keeps PLL B fractional with denom = 10^6 as AN619 requires.
+ * si5351_SetupVCXO() programs PLL B and the pull range. si5351_TuneVCXO() moves
+ * the VC voltage while the new frequency is within the pull range of the current
+ * PLL B settings and falls back to register writes for coarse steps.
+ */
+void si5351_SetVariant(si5351Variant_t variant);
+void si5351_CalcVCXO(int32_t Fclk, si5351PLLConfig_t* pll_conf, si5351OutputConfig_t* out_conf);
+int si5351_SetupVCXO(uint16_t aprPpm, si5351PLLConfig_t* conf);
+void si5351_SetVCOutput(si5351VCOutput_t output, uint16_t vddMillivolts);
+int si5351_SetVCXOOffset(int32_t offsetPpb);
+int si5351_TuneVCXO(uint8_t output, int32_t Fclk, si5351DriveStrength_t driveStrength);
+
+/*
+ * Fast calculation, e.g. for FSK or fast sweeps on a slow CPU.
+ *
+ * si5351_CalcFast() gives the register image for Fclk with a few multiplications
+ * and no divisions: P3 is always 2^13 and 1/Fclk comes from a table of reciprocals
+ * refined with one Newton step. The result is within 4 Hz of Fclk, si5351_Calc()
+ * is off by up to 6.8 Hz just below 81 MHz. si5351_SetupImage() programs an output
+ * from an image, only registers that differ from the ones written before are sent.
+ */
+void si5351_CalcFast(int32_t Fclk, si5351RegImage_t* image);
+int si5351_SetupImage(uint8_t output, si5351PLL_t pll, si5351DriveStrength_t driveStrength, const si5351RegImage_t* image);
+
+/*
+ * Exact frequency ratios, e.g. for mixers and clock trees.
+ *
+ * Independent si5351_Calc() calls round every output separately, so CLK1 = 4 * CLK0
+ * holds only within a few ppb. si5351_CalcRatio() takes the ratios of up to 3 outputs
+ * to a base frequency Fclk and finds one PLL setting and MS/R dividers that keep
+ * the ratios exact, the absolute error is minimized after that. Set up the PLL and
+ * all outputs from the same PLL.
+ */
+int si5351_CalcRatio(int32_t Fclk, const si5351Ratio_t* ratios, uint8_t count, si5351PLLConfig_t* pll_conf, si5351OutputConfig_t* out_confs);
+
+/*
+ * Sweeps and scans.
+ *
+ * si5351_PlanSweep() calculates all settings up front and orders the frequencies so
+ * that consecutive steps share the PLL settings as often as possible: every PLL change
+ * costs a PLL reset, i.e. an output glitch and the lock time. With SI5351_SWEEP_ANY_ORDER
+ * the list is sorted, so everything below 81 MHz runs from the same 900 MHz PLL and only
+ * MS bytes change. With SI5351_SWEEP_MONOTONIC_SEGMENTS consecutive entries with the same
+ * segments[] value form a segment, segments are visited in the given order and the
+ * direction of each one is chosen to make the junctions cheap. segments can be NULL,
+ * then the whole list is one segment. Every step keeps the register image and the bytes
+ * that differ from the previous step, si5351_ApplySweepStep() writes only those and
+ * resets only the PLL it uses. The PLL should not drive other outputs during the sweep.
+ */
+int si5351_PlanSweep(const int32_t* freqs, const uint8_t* segments, uint16_t count, si5351SweepOrder_t order, si5351SweepStep_t* steps);
+int si5351_ApplySweepStep(uint8_t output, si5351PLL_t pll, si5351DriveStrength_t driveStrength, const si5351SweepStep_t* step);
+
+/*
+ * Bus scheduler, for keying, hops, telemetry and verification from several tasks.
+ *
+ * si5351_Queue*() can be called from any task, the job is copied into a queue of
+ * SI5351_SCHED_JOBS entries. One task owns the bus and calls si5351_RunBus(), every
+ * call does one step: a single burst for writes, restore and readback, or one
+ * si5351_SetupImage(). The step is taken from the highest class that has work, so
+ * urgent work waits for at most one step of a lower class. Restore and readback go
+ * through the shadow copy in chunks of up to SI5351_SCHED_CHUNK registers to keep
+ * the steps short, a restore holds the outputs disabled except the ones switched by
+ * urgent jobs. Latencies are collected per class, see si5351_GetSchedStats().
+ * While the scheduler is used only the bus task should call other si5351_*() functions.
+ */
+int si5351_QueueWrite(si5351Priority_t priority, uint8_t reg, const uint8_t* data, uint8_t len);
+int si5351_QueueEnableOutputs(si5351Priority_t priority, uint8_t enabled);
+int si5351_QueueImage(si5351Priority_t priority, uint8_t output, si5351PLL_t pll, si5351DriveStrength_t driveStrength, const si5351RegImage_t* image);
+int si5351_QueueRestore(si5351Priority_t priority);
+int si5351_QueueReadback(si5351Priority_t priority);
+uint8_t si5351_RunBus(void);
+void si5351_SetBusPolicy(si5351BusPolicy_t policy);
+void si5351_GetSchedStats(si5351SchedStats_t* stats);
+void si5351_ResetSchedStats(void);
+
+/*
+ * Commits: several changes reach the chip together or not at all.
+ *
+ * Between si5351_BeginCommit() and si5351_EndCommit() setup calls only collect their
+ * writes. If a write fails halfway through sending them, the chip is left with a mix
+ * of old and new registers: the driver either writes the rest of the commit or writes
+ * the registers changed so far back to their values before si5351_BeginCommit(),
+ * whichever is fewer bytes on the bus, and reports which one it was. PLLs whose
+ * registers are written back are reset again.
+ */
+void si5351_BeginCommit(void);
+int si5351_EndCommit(void);
+void si5351_AbortCommit(void);
+
+/*
+ * Configuration journal, keeps the configuration over power cycles.
+ *
+ * si5351_SaveJournal() appends only the registers changed since the last call, a few
+ * bytes per retune. When the sector is full the whole configuration is written to the
+ * next sector as a snapshot and the deltas continue there, so the erases go round all
+ * sectors. Every record has a CRC and a snapshot counts only once it's complete, so
+ * a power cut loses at most the record being written. Call si5351_LoadJournal() after
+ * si5351_Init(): it replays the newest snapshot and the deltas after it and writes
+ * only the registers that differ from the ones si5351_Init() set, in as few bursts
+ * as possible. The VC voltage of si5351_SetVCXOOffset() is not kept.
+ */
+int si5351_LoadJournal(const si5351Storage_t* storage);
+int si5351_SaveJournal(void);
+int si5351_CompactJournal(void);
+void si5351_GetJournalStats(si5351JournalStats_t* stats);
+
+/*
+ * I2C bus recovery.
+ *
+ * A failed write is retried once right away. If it fails again (e.g. the Si5351 was
+ * reset or hit by ESD in the middle of a transfer and holds SDA low) the driver
+ * releases the I2C controller, clocks SCL until the slave releases SDA and generates
+ * STOP if a line is held low, restarts the controller and retries the write. All
+ * registers set so far are written back from the shadow copy only when the chip lost
+ * them or the write still fails. Every stage is bounded in time, see si5351_GetBusStats().
+ */
+int si5351_RecoverBus(void);
+void si5351_GetBusStats(si5351BusStats_t* stats);
+
+/*
+ * Configuration snapshot for UI and telemetry.
+ *
+ * Every call that changes the configuration publishes a copy of it. Publishing
+ * never blocks and si5351_GetSnapshot() can be called from any number of tasks
+ * at any time. It's lock-free rather than wait-free: readers don't take locks and
+ * always read the copy the writer isn't updating, but repeat the copy when an
+ * update completes in the middle of it, so a writer publishing back to back can
+ * delay a reader.
+ */
+void si5351_GetSnapshot(si5351Snapshot_t* snapshot);
+
 #endif
@@ -0,0 +1,217 @@
+// vim: set ai et ts=4 sw=4:
+
+#include <Arduino.h>
+#include <si5351.h>
+#include "si5351_private.h"
+
+// Writes one commit can stage: bursts and their data bytes
+#define SI5351_COMMIT_BURSTS 32
+#define SI5351_COMMIT_BYTES 192
+
+// PLL A registers 26..33, PLL B registers 34..41
+#define SI5351_PLL_A_FIRST 26
+#define SI5351_PLL_B_FIRST 34
+#define SI5351_PLL_B_LAST 41
+
+typedef struct {
+    uint8_t reg;
+    uint8_t len;
+    uint8_t offset;         // of the data in si5351CommitData
+} si5351Burst_t;
+
+// Set between si5351_BeginCommit() and si5351_EndCommit(), si5351_writeBurst()
+// passes the bursts to si5351_stage() instead of the bus meanwhile.
+uint8_t si5351Staging = 0;
+
+static uint8_t si5351StageOverflow = 0;
+static si5351Burst_t si5351Bursts[SI5351_COMMIT_BURSTS];
+static uint8_t si5351BurstCount = 0;
+static uint8_t si5351CommitData[SI5351_COMMIT_BYTES];
+static uint8_t si5351CommitBytes = 0;
+
+// Configuration before si5351_BeginCommit(), the last one the chip is known to have
+static si5351State_t si5351Committed;
+
+/**
+ * @brief Adds a burst to the commit, called by si5351_writeBurst() while staging
+ *
+ * @param reg
+ * @param data
+ * @param len
+ * @return uint8_t Returns 0 on success, 1 if the commit is too large.
+ */
+uint8_t si5351_stage(uint8_t reg, const uint8_t* data, uint8_t len) {
+    if((si5351BurstCount == SI5351_COMMIT_BURSTS) || (si5351CommitBytes + len > SI5351_COMMIT_BYTES)) {
+        si5351StageOverflow = 1;
+        return 1;
+    }
+    si5351Burst_t* burst = &si5351Bursts[si5351BurstCount++];
+    burst->reg = reg;
+    burst->len = len;
+    burst->offset = si5351CommitBytes;
+    memcpy(&si5351CommitData[si5351CommitBytes], data, len);
+    si5351CommitBytes += len;
+    return 0;
+}
+
+/**
+ * @brief Finds the registers that have to be written back after burst `failed` failed.
+ * Bursts before it reached the chip, the failed one may have reached it in part.
+ *
+ * @param failed
+ * @param mask 256 bits, the registers to write back
+ * @return uint32_t bus bytes of the rollback, UINT32_MAX if a register the commit
+ * changed had no known value before it.
+ */
+static uint32_t si5351_undoPlan(uint8_t failed, uint8_t* mask) {
+    const uint8_t* before = si5351Committed.shadow;
+    const uint8_t* known = si5351Committed.shadowValid;
+    uint8_t chip[256];
+    memcpy(chip, before, sizeof(chip));
+    memset(mask, 0, 256/8);
+
+    for(uint8_t i = 0; i <= failed; i++) {
+        const si5351Burst_t* burst = &si5351Bursts[i];
+        for(uint8_t j = 0; j < burst->len; j++) {
+            uint8_t r = burst->reg + j;
+            uint8_t d = si5351CommitData[burst->offset + j];
+            if(r == SI5351_REGISTER_177_PLL_RESET) {
+                continue;
+            }
+            if(!si5351_maskBit(known, r)) {
+                return UINT32_MAX;
+            }
+            if(i < failed) {
+                chip[r] = d;
+            } else if(d != chip[r]) {
+                // either value can be on the chip
+                mask[r >> 3] |= 1 << (r & 7);
+            }
+        }
+    }
+    for(int r = 0; r < 256; r++) {
+        if(chip[r] != before[r]) {
+            mask[r >> 3] |= 1 << (r & 7);
+        }
+    }
+
+    // Counted with the old shadow copy, the runs are the same
+    uint32_t bytes = si5351_writeRuns(mask, 0, NULL);
+    for(int r = SI5351_PLL_A_FIRST; r <= SI5351_PLL_B_LAST; r++) {
+        if(si5351_maskBit(mask, r)) {
+            bytes += 3; // PLL reset
+            break;
+        }
+    }
+    return bytes;
+}
+
+/**
+ * @brief Brings the chip to a consistent configuration after burst `failed` failed
+ * twice: writes the rest of the commit or the registers it changed so far back,
+ * whichever takes fewer bus bytes.
+ *
+ * @param failed
+ * @return int si5351_EndCommit() result
+ */
+static int si5351_resolve(uint8_t failed) {
+    uint8_t mask[256/8];
+    uint32_t backward = si5351_undoPlan(failed, mask);
+    uint32_t forward = 0;
+    for(uint8_t i = failed; i < si5351BurstCount; i++) {
+        forward += 2 + si5351Bursts[i].len;
+    }
+
+    if(forward <= backward) {
+        // With bus recovery, a replay of the new configuration is the last resort
+        si5351BusStats.rollForwards++;
+        for(uint8_t i = failed; i < si5351BurstCount; i++) {
+            const si5351Burst_t* burst = &si5351Bursts[i];
+            if(si5351_writeBurst(burst->reg, &si5351CommitData[burst->offset], burst->len) != 0) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    si5351BusStats.rollbacks++;
+    si5351_restoreState(&si5351Committed);
+    uint8_t writeFailed = 0;
+    si5351_writeRuns(mask, 1, &writeFailed);
+    uint8_t reset = 0;
+    for(int r = SI5351_PLL_A_FIRST; r <= SI5351_PLL_B_LAST; r++) {
+        if(si5351_maskBit(mask, r)) {
+            reset |= (r < SI5351_PLL_B_FIRST) ? (1<<5) : (1<<7);
+        }
+    }
+    if(reset && (si5351_writeBurst(SI5351_REGISTER_177_PLL_RESET, &reset, 1) != 0)) {
+        writeFailed = 1;
+    }
+    return writeFailed ? 1 : 3;
+}
+
+/**
+ * @brief Starts a commit: the following si5351_Setup*(), si5351_EnableOutputs() etc.
+ * calls are collected and sent by si5351_EndCommit()
+ */
+void si5351_BeginCommit(void) {
+    si5351_saveState(&si5351Committed);
+    si5351BurstCount = 0;
+    si5351CommitBytes = 0;
+    si5351StageOverflow = 0;
+    si5351Staging = 1;
+}
+
+/**
+ * @brief Sends the writes collected since si5351_BeginCommit(). If a burst fails twice
+ * the chip is brought either to the new configuration (the rest of the commit is written,
+ * recovering the bus if needed) or back to the one before si5351_BeginCommit() (only the
+ * registers changed so far are written back), depending on which takes fewer bus bytes.
+ *
+ * @return int Returns 0 on success, 1 if the bus couldn't be recovered, 2 if the commit
+ * was too large and nothing was sent, 3 if the chip was rolled back to the configuration
+ * before si5351_BeginCommit(). The driver keeps the configuration the chip has.
+ */
+int si5351_EndCommit(void) {
+    if(!si5351Staging) {
+        return 0;
+    }
+    si5351Staging = 0;
+    if(si5351StageOverflow) {
+        si5351_restoreState(&si5351Committed);
+        return 2;
+    }
+
+    int result = 0;
+    for(uint8_t i = 0; i < si5351BurstCount; i++) {
+        const si5351Burst_t* burst = &si5351Bursts[i];
+        const uint8_t* data = &si5351CommitData[burst->offset];
+        uint8_t status = si5351_transmit(burst->reg, data, burst->len);
+        if(status != 0) {
+            // Transient error, e.g. a single NACK
+            si5351BusStats.busErrors++;
+            status = si5351_transmit(burst->reg, data, burst->len);
+        }
+        if(status != 0) {
+            result = si5351_resolve(i);
+            break;
+        }
+        if((burst->reg <= SI5351_REGISTER_177_PLL_RESET) && (burst->reg + burst->len > SI5351_REGISTER_177_PLL_RESET)) {
+            si5351PLLResets++;
+        }
+    }
+
+    si5351_publish();
+    return result;
+}
+
+/**
+ * @brief Drops the writes collected since si5351_BeginCommit(), nothing is sent
+ */
+void si5351_AbortCommit(void) {
+    if(!si5351Staging) {
+        return;
+    }
+    si5351Staging = 0;
+    si5351_restoreState(&si5351Committed);
+}
@@ -0,0 +1,129 @@
+// vim: set ai et ts=4 sw=4:
+
+#include <Arduino.h>
+#include <si5351.h>
+#include "si5351_private.h"
+
+// si5351_CalcFast() programs P3 = 2^13, so P1 and P2 are the integer and the
+// fractional part of Q = 128 * P3 * (a + b/c) = 2^20 * (a + b/c).
+#define SI5351_FAST_P3_BITS 13
+
+// Reciprocal table: 1/m for m in [1, 2) in 256 linear segments
+#define SI5351_FAST_TABLE_BITS 8
+
+// round(2^52 / 25 MHz): Q of the PLL is x * Fclk * 2^20 / Fxtal
+#define SI5351_FAST_INV_FXTAL 180143985LL
+
+// round(2^48 / 10^8): correction is given in 10^-8 units
+#define SI5351_FAST_INV_1E8 2814750LL
+
+// 900 MHz / 2^8, the rest of 900 MHz goes to the shifts
+#define SI5351_FAST_FPLL_ODD 3515625LL
+
+// round(2^62 / m) for m = 2^31 + i * 2^23, i.e. 2^31 / (1 + i/256)
+static uint32_t si5351FastTable[(1 << SI5351_FAST_TABLE_BITS) + 1];
+static uint8_t si5351FastTableReady = 0;
+
+/**
+ * @brief Fills the reciprocal table. The only divisions of the fast path,
+ * done once on the first call.
+ */
+static void si5351_fastTable(void) {
+    for(int i = 0; i <= (1 << SI5351_FAST_TABLE_BITS); i++) {
+        uint64_t m = (1ULL << 31) + ((uint64_t)i << (31 - SI5351_FAST_TABLE_BITS));
+        si5351FastTable[i] = (uint32_t)(((1ULL << 62) + m/2) / m);
+    }
+    si5351FastTableReady = 1;
+}
+
+/**
+ * @brief Calculates Q = 2^20 * 900 MHz / Fclk
+ *
+ * 1/Fclk comes from the table: Fclk is normalized to m in [2^31, 2^32), 1/m is
+ * interpolated between two table entries (relative error < 3.9e-6) and refined
+ * with one Newton step (error squared, < 2e-11). Q is up to 1.8e9, so the result
+ * is within 0.54 of the exact value.
+ *
+ * @param Fclk in [512_000, 81_000_000) range
+ * @return uint32_t
+ */
+static uint32_t si5351_fastMS(int32_t Fclk) {
+    int shift = __builtin_clz((uint32_t)Fclk);
+    uint32_t m = (uint32_t)Fclk << shift;
+
+    // r0 ~ 2^62 / m
+    uint32_t idx = (m >> (31 - SI5351_FAST_TABLE_BITS)) - (1 << SI5351_FAST_TABLE_BITS);
+    uint32_t frac = (m >> (15 - SI5351_FAST_TABLE_BITS)) & 0xFFFF;
+    uint32_t r0 = si5351FastTable[idx] - (uint32_t)(((uint64_t)(si5351FastTable[idx] - si5351FastTable[idx + 1]) * frac) >> 16);
+
+    // Newton step r1 = r0 * (2 - m*r0), r1 ~ 2^70 / m
+    int64_t e = (int64_t)((1ULL << 62) - (uint64_t)m * r0);
+    int64_t r1 = ((int64_t)r0 << 8) + (((int64_t)r0 * (e >> 13)) >> 41);
+
+    // Q = 900 MHz * 2^20 / Fclk = 3515625 * 2^28 * 2^shift / m
+    int s = 42 - shift;
+    return (uint32_t)((SI5351_FAST_FPLL_ODD * r1 + (1LL << (s - 1))) >> s);
+}
+
+/**
+ * @brief Packs Q = 2^20 * (a + b/c) as P1, P2 and P3 = 2^13
+ */
+static void si5351_fastEncode(uint32_t Q, si5351RDiv_t rdiv, uint8_t* regs) {
+    int32_t P1 = (int32_t)(Q >> SI5351_FAST_P3_BITS) - 512;
+    int32_t P2 = Q & ((1 << SI5351_FAST_P3_BITS) - 1);
+    si5351_encodeBulk(P1, P2, 1 << SI5351_FAST_P3_BITS, 0, rdiv, regs);
+}
+
+/**
+ * @brief Calculates the register image for given Fclk in [8_000, 160_000_000] range
+ * without divisions, in the same regimes as si5351_Calc(). The actual frequency will
+ * differ less than 4 Hz from given Fclk, assuming `correction` is right.
+ *
+ * Below 81 MHz the PLL runs @ 900 MHz and MS = 900 MHz / Fclk, the error is at most
+ * 0.54 * 2^-20 * Fclk^2 / 900 MHz, i.e. 3.8 Hz @ 81 MHz and 0.4 Hz @ 27 MHz.
+ * Above 81 MHz MS is 8, 6 or 4 and the PLL is fractional, the error is at most
+ * 13.7 Hz / MS.
+ *
+ * @param Fclk
+ * @param image
+ */
+void si5351_CalcFast(int32_t Fclk, si5351RegImage_t* image) {
+    if(!si5351FastTableReady) {
+        si5351_fastTable();
+    }
+
+    if(Fclk < 8000) Fclk = 8000;
+    else if(Fclk > 160000000) Fclk = 160000000;
+
+    si5351RDiv_t rdiv = SI5351_R_DIV_1;
+    if(Fclk < 1000000) {
+        Fclk <<= 6;
+        rdiv = SI5351_R_DIV_64;
+    }
+
+    // Fclk * (1 - correction * 10^-8), _after_ determining rdiv
+    int64_t scaled = ((int64_t)Fclk * SI5351_FAST_INV_1E8) >> 16;
+    Fclk -= (int32_t)((scaled * si5351Correction) >> 32);
+
+    if(Fclk < 81000000) {
+        // PLL @ 900 MHz: a = 36, b = 0, c = 1
+        si5351_encodeBulk(128 * 36 - 512, 0, 1, 0, SI5351_R_DIV_1, image->pll);
+        uint32_t Q = si5351_fastMS(Fclk);
+        si5351_fastEncode(Q, rdiv, image->ms);
+        image->intMode = (Q & ((1 << 20) - 1)) == 0;
+    } else {
+        int32_t x;
+        if(Fclk >= 150000000) {
+            x = 4;
+            // special DIVBY4 case, see AN619 4.1.3
+            si5351_encodeBulk(0, 0, 1, 0x3, rdiv, image->ms);
+        } else {
+            x = (Fclk >= 100000000) ? 6 : 8;
+            si5351_encodeBulk(128 * x - 512, 0, 1, 0, rdiv, image->ms);
+        }
+        image->intMode = 1;
+
+        uint32_t Q = (uint32_t)(((int64_t)x * Fclk * SI5351_FAST_INV_FXTAL + (1LL << 31)) >> 32);
+        si5351_fastEncode(Q, SI5351_R_DIV_1, image->pll);
+    }
+}
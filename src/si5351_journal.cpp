@@ -0,0 +1,497 @@
+// vim: set ai et ts=4 sw=4:
+
+#include <Arduino.h>
+#include <si5351.h>
+#include "si5351_private.h"
+
+// Sector header: magic (2), sequence number (4), complete flag (1), CRC of the first 6 bytes (1).
+// The flag is 0xFF while the snapshot is written and 0x00 after it.
+#define SI5351_JOURNAL_MAGIC0 0x51
+#define SI5351_JOURNAL_MAGIC1 0x35
+#define SI5351_JOURNAL_HEADER 8
+#define SI5351_JOURNAL_COMPLETE 6
+
+// Record: tag, payload length, payload, CRC of all of it, commit byte. The payload is
+// a list of runs: first register, number of registers, their values. One record is one
+// save. The commit byte is programmed to 0x00 after the rest, a record torn by a power
+// cut lacks it or fails the CRC and none of its runs are used. An erased byte (0xFF)
+// where a tag is expected is the end of the journal.
+#define SI5351_JOURNAL_TAG 0x52
+#define SI5351_JOURNAL_OVERHEAD 4
+#define SI5351_JOURNAL_RUN_OVERHEAD 2
+#define SI5351_JOURNAL_MAX_PAYLOAD 255
+
+// Storage reads during replay go through a buffer of this size
+#define SI5351_JOURNAL_READ_BUFFER 64
+
+#define SI5351_JOURNAL_NO_SECTOR 0xFF
+
+static const si5351Storage_t* si5351Storage = NULL;
+static uint8_t si5351JournalSector = SI5351_JOURNAL_NO_SECTOR;
+static uint32_t si5351JournalSeq = 0;
+static uint32_t si5351JournalOffset = 0;    // next free byte in the sector
+// Bytes after the last good record aren't erased, nothing can be appended
+static uint8_t si5351JournalDirty = 0;
+static si5351JournalStats_t si5351JournalStats;
+
+// Registers as the journal has them
+static uint8_t si5351JournalImage[256];
+static uint8_t si5351JournalValid[256/8];
+
+// Replay read buffer
+static uint8_t si5351ReadBuffer[SI5351_JOURNAL_READ_BUFFER];
+static uint32_t si5351ReadAddr;
+static uint32_t si5351ReadLen = 0;
+
+/**
+ * @brief CRC-8, polynomial 0x07
+ */
+static uint8_t si5351_crc8(uint8_t crc, const uint8_t* data, uint32_t len) {
+    for(uint32_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for(int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+/**
+ * @brief Reads from the storage through the replay buffer, within one sector
+ *
+ * @return int Returns 0 on success, != 0 otherwise.
+ */
+static int si5351_journalRead(uint32_t addr, uint8_t* data, uint32_t len) {
+    while(len > 0) {
+        if((addr < si5351ReadAddr) || (addr >= si5351ReadAddr + si5351ReadLen)) {
+            uint32_t sectorEnd = (addr / si5351Storage->sectorSize + 1) * si5351Storage->sectorSize;
+            si5351ReadLen = sectorEnd - addr;
+            if(si5351ReadLen > SI5351_JOURNAL_READ_BUFFER) {
+                si5351ReadLen = SI5351_JOURNAL_READ_BUFFER;
+            }
+            si5351ReadAddr = addr;
+            if(si5351Storage->read(addr, si5351ReadBuffer, si5351ReadLen) != 0) {
+                si5351ReadLen = 0;
+                return 1;
+            }
+        }
+        uint32_t n = si5351ReadAddr + si5351ReadLen - addr;
+        if(n > len) {
+            n = len;
+        }
+        memcpy(data, &si5351ReadBuffer[addr - si5351ReadAddr], n);
+        addr += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads the sector header
+ *
+ * @param sector
+ * @param seq
+ * @return uint8_t Returns 1 if the sector holds a complete snapshot.
+ */
+static uint8_t si5351_journalHeader(uint8_t sector, uint32_t* seq) {
+    uint8_t header[SI5351_JOURNAL_HEADER];
+    if(si5351Storage->read(sector * si5351Storage->sectorSize, header, sizeof(header)) != 0) {
+        return 0;
+    }
+    if((header[0] != SI5351_JOURNAL_MAGIC0) || (header[1] != SI5351_JOURNAL_MAGIC1) ||
+       (header[SI5351_JOURNAL_COMPLETE] != 0x00) || (header[7] != si5351_crc8(0, header, 6))) {
+        return 0;
+    }
+    *seq = (uint32_t)header[2] | ((uint32_t)header[3] << 8) | ((uint32_t)header[4] << 16) | ((uint32_t)header[5] << 24);
+    return 1;
+}
+
+/**
+ * @brief Applies the runs of a record to the journal image
+ *
+ * @return uint8_t Returns 0 if the payload is malformed, nothing is applied then.
+ */
+static uint8_t si5351_journalApply(const uint8_t* payload, uint16_t len) {
+    for(uint8_t pass = 0; pass < 2; pass++) {
+        uint16_t i = 0;
+        while(i < len) {
+            if(i + SI5351_JOURNAL_RUN_OVERHEAD > len) {
+                return 0;
+            }
+            uint8_t reg = payload[i];
+            uint8_t n = payload[i + 1];
+            if((n == 0) || (reg + n > 256) || (i + SI5351_JOURNAL_RUN_OVERHEAD + n > len)) {
+                return 0;
+            }
+            for(uint8_t k = 0; pass && (k < n); k++) {
+                uint8_t r = reg + k;
+                si5351JournalImage[r] = payload[i + SI5351_JOURNAL_RUN_OVERHEAD + k];
+                si5351JournalValid[r >> 3] |= 1 << (r & 7);
+            }
+            i += SI5351_JOURNAL_RUN_OVERHEAD + n;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Reads the records of the sector into the journal image
+ *
+ * @param sector
+ */
+static void si5351_journalReplay(uint8_t sector) {
+    uint32_t size = si5351Storage->sectorSize;
+    uint32_t base = sector * size;
+    uint32_t offset = SI5351_JOURNAL_HEADER;
+    uint8_t record[SI5351_JOURNAL_OVERHEAD + SI5351_JOURNAL_MAX_PAYLOAD];
+    si5351ReadLen = 0;
+
+    while(offset + SI5351_JOURNAL_OVERHEAD <= size) {
+        if(si5351_journalRead(base + offset, record, 2) != 0) {
+            si5351JournalDirty = 1;
+            break;
+        }
+        if(record[0] == 0xFF) {
+            // The end. A torn write can leave programmed bytes after an erased one.
+            uint32_t rest = size - offset;
+            if(rest > sizeof(record)) {
+                rest = sizeof(record);
+            }
+            if(si5351_journalRead(base + offset, record, rest) != 0) {
+                si5351JournalDirty = 1;
+            }
+            for(uint32_t i = 0; i < rest; i++) {
+                if(record[i] != 0xFF) {
+                    si5351JournalDirty = 1;
+                }
+            }
+            break;
+        }
+        uint8_t len = record[1];
+        if((record[0] != SI5351_JOURNAL_TAG) || (len == 0) ||
+           (offset + SI5351_JOURNAL_OVERHEAD + len > size) ||
+           (si5351_journalRead(base + offset + 2, record + 2, len + 2) != 0) ||
+           (record[2 + len] != si5351_crc8(0, record, 2 + len)) || (record[3 + len] != 0x00) ||
+           !si5351_journalApply(record + 2, len)) {
+            // Torn by a power cut
+            si5351JournalDirty = 1;
+            break;
+        }
+        si5351JournalStats.replayRecords++;
+        offset += SI5351_JOURNAL_OVERHEAD + len;
+    }
+    si5351JournalOffset = offset;
+}
+
+/**
+ * @brief Collects runs of the registers selected by mask from the shadow copy, starting
+ * at *from, until the payload is full. Runs are merged over gaps of up to 2 known registers.
+ *
+ * @param mask 256 bits
+ * @param from first register to look at, set to the next one
+ * @param payload SI5351_JOURNAL_MAX_PAYLOAD bytes
+ * @return uint16_t payload length
+ */
+static uint16_t si5351_journalPayload(const uint8_t* mask, uint16_t* from, uint8_t* payload) {
+    uint16_t len = 0;
+    int i = *from;
+    while(i < 256) {
+        if(!si5351_maskBit(mask, i)) {
+            i++;
+            continue;
+        }
+        if(len + SI5351_JOURNAL_RUN_OVERHEAD + 1 > SI5351_JOURNAL_MAX_PAYLOAD) {
+            break;
+        }
+        int end = i;
+        for(int j = i + 1; (j < 256) && (j - end <= SI5351_JOURNAL_RUN_OVERHEAD + 1); j++) {
+            if(!si5351_shadowValid(j) || (j == SI5351_REGISTER_177_PLL_RESET)) {
+                break;
+            }
+            if(si5351_maskBit(mask, j)) {
+                end = j;
+            }
+        }
+        int n = end - i + 1;
+        if(len + SI5351_JOURNAL_RUN_OVERHEAD + n > SI5351_JOURNAL_MAX_PAYLOAD) {
+            n = SI5351_JOURNAL_MAX_PAYLOAD - len - SI5351_JOURNAL_RUN_OVERHEAD;
+        }
+        payload[len++] = (uint8_t)i;
+        payload[len++] = (uint8_t)n;
+        memcpy(&payload[len], &si5351Shadow[i], n);
+        len += n;
+        i += n;
+    }
+    *from = i;
+    return len;
+}
+
+/**
+ * @brief Storage bytes of the records for the registers selected by mask
+ *
+ * @param mask
+ * @param records set to the number of records
+ * @return uint32_t
+ */
+static uint32_t si5351_journalSize(const uint8_t* mask, uint16_t* records) {
+    uint8_t payload[SI5351_JOURNAL_MAX_PAYLOAD];
+    uint32_t bytes = 0;
+    uint16_t from = 0;
+    *records = 0;
+    while(from < 256) {
+        uint16_t len = si5351_journalPayload(mask, &from, payload);
+        if(len > 0) {
+            bytes += SI5351_JOURNAL_OVERHEAD + len;
+            (*records)++;
+        }
+    }
+    return bytes;
+}
+
+/**
+ * @brief Appends the records for the registers selected by mask to the sector
+ *
+ * @return int Returns 0 on success, 1 if a write failed.
+ */
+static int si5351_journalAppend(const uint8_t* mask, uint8_t sector) {
+    uint8_t record[SI5351_JOURNAL_OVERHEAD + SI5351_JOURNAL_MAX_PAYLOAD];
+    uint16_t from = 0;
+    while(from < 256) {
+        uint16_t len = si5351_journalPayload(mask, &from, record + 2);
+        if(len == 0) {
+            continue;
+        }
+        record[0] = SI5351_JOURNAL_TAG;
+        record[1] = (uint8_t)len;
+        record[2 + len] = si5351_crc8(0, record, 2 + len);
+        uint8_t commit = 0x00;
+        uint32_t addr = sector * si5351Storage->sectorSize + si5351JournalOffset;
+        if((si5351Storage->write(addr, record, 3 + len) != 0) ||
+           (si5351Storage->write(addr + 3 + len, &commit, 1) != 0)) {
+            si5351JournalDirty = 1;
+            return 1;
+        }
+        si5351JournalOffset += SI5351_JOURNAL_OVERHEAD + len;
+        si5351JournalStats.bytesWritten += SI5351_JOURNAL_OVERHEAD + len;
+    }
+    return 0;
+}
+
+/**
+ * @brief Marks the shadow registers that differ from the journal, or all of them
+ *
+ * @param mask 256 bits
+ * @param all
+ * @return uint8_t Returns 1 if any register is marked.
+ */
+static uint8_t si5351_journalDiff(uint8_t* mask, uint8_t all) {
+    uint8_t any = 0;
+    memset(mask, 0, 256/8);
+    for(int r = 0; r < 256; r++) {
+        if(!si5351_shadowValid(r) || (r == SI5351_REGISTER_177_PLL_RESET)) {
+            continue;
+        }
+        if(all || !si5351_maskBit(si5351JournalValid, r) || (si5351JournalImage[r] != si5351Shadow[r])) {
+            mask[r >> 3] |= 1 << (r & 7);
+            any = 1;
+        }
+    }
+    return any;
+}
+
+/**
+ * @brief The journal has the registers selected by mask now
+ */
+static void si5351_journalTake(const uint8_t* mask) {
+    for(int r = 0; r < 256; r++) {
+        if(si5351_maskBit(mask, r)) {
+            si5351JournalImage[r] = si5351Shadow[r];
+            si5351JournalValid[r >> 3] |= 1 << (r & 7);
+        }
+    }
+}
+
+/**
+ * @brief Writes the registers from the journal that differ from the shadow copy to
+ * the chip: outputs are disabled meanwhile, registers go in runs, PLLs whose
+ * registers changed are reset.
+ *
+ * @return uint8_t Returns 0 on success, != 0 otherwise.
+ */
+static uint8_t si5351_journalRestore(void) {
+    const uint8_t enable = SI5351_REGISTER_3_OUTPUT_ENABLE_CONTROL;
+    uint8_t mask[256/8];
+    uint8_t any = 0;
+    memset(mask, 0, sizeof(mask));
+    for(int r = 0; r < 256; r++) {
+        if((r == enable) || (r == SI5351_REGISTER_177_PLL_RESET) || !si5351_maskBit(si5351JournalValid, r)) {
+            continue;
+        }
+        if(!si5351_shadowValid(r) || (si5351Shadow[r] != si5351JournalImage[r])) {
+            mask[r >> 3] |= 1 << (r & 7);
+            any = 1;
+        }
+    }
+
+    uint8_t failed = 0;
+    if(any) {
+        failed |= si5351_writeChanged(enable, 0xFF);
+        for(int r = 0; r < 256; r++) {
+            if(si5351_maskBit(mask, r)) {
+                si5351Shadow[r] = si5351JournalImage[r];
+                si5351ShadowValid[r >> 3] |= 1 << (r & 7);
+            }
+        }
+        si5351_writeRuns(mask, 1, &failed);
+
+        uint8_t reset = 0;
+        for(int r = 26; r <= 41; r++) {
+            if(si5351_maskBit(mask, r)) {
+                reset |= (r < 34) ? (1<<5) : (1<<7);
+            }
+        }
+        if(reset) {
+            failed |= si5351_write(SI5351_REGISTER_177_PLL_RESET, reset);
+        }
+    }
+    if(si5351_maskBit(si5351JournalValid, enable)) {
+        failed |= si5351_writeChanged(enable, si5351JournalImage[enable]);
+    }
+    return failed;
+}
+
+/**
+ * @brief Attaches the storage, replays the newest snapshot and the deltas after it
+ * and brings the chip to the configuration they describe. Call it after si5351_Init().
+ *
+ * @param storage is used until the next call, keep it
+ * @return int Returns 0 on success, 1 if the chip couldn't be written, 2 if the storage
+ * has no configuration yet, 3 if the storage is too small.
+ */
+int si5351_LoadJournal(const si5351Storage_t* storage) {
+    uint32_t start = micros();
+    memset(&si5351JournalStats, 0, sizeof(si5351JournalStats));
+    memset(si5351JournalValid, 0, sizeof(si5351JournalValid));
+    si5351JournalSector = SI5351_JOURNAL_NO_SECTOR;
+    si5351JournalOffset = 0;
+    si5351JournalDirty = 0;
+    si5351Storage = NULL;
+    if((storage == NULL) || (storage->sectors < 2) || (storage->sectors == SI5351_JOURNAL_NO_SECTOR) ||
+       (storage->sectorSize < 512)) {
+        return 3;
+    }
+    si5351Storage = storage;
+
+    // Newest complete snapshot, the sequence number wraps around
+    for(uint8_t sector = 0; sector < storage->sectors; sector++) {
+        uint32_t seq;
+        if(si5351_journalHeader(sector, &seq) &&
+           ((si5351JournalSector == SI5351_JOURNAL_NO_SECTOR) || ((int32_t)(seq - si5351JournalSeq) > 0))) {
+            si5351JournalSector = sector;
+            si5351JournalSeq = seq;
+        }
+    }
+    if(si5351JournalSector == SI5351_JOURNAL_NO_SECTOR) {
+        return 2;
+    }
+    si5351_journalReplay(si5351JournalSector);
+
+    uint32_t bytes = si5351Bytes;
+    uint8_t failed = si5351_journalRestore();
+    si5351JournalStats.restoreBytes = si5351Bytes - bytes;
+    si5351_adoptShadow();
+    si5351_publish();
+    si5351JournalStats.replayMicros = micros() - start;
+    return failed ? 1 : 0;
+}
+
+/**
+ * @brief Writes the whole configuration to the next sector as a snapshot. The previous
+ * snapshot counts until the new one is complete.
+ *
+ * @return int Returns 0 on success, 1 on storage errors or if the configuration
+ * doesn't fit a sector, 2 if no storage is attached.
+ */
+int si5351_CompactJournal(void) {
+    if(si5351Storage == NULL) {
+        return 2;
+    }
+    uint8_t mask[256/8];
+    uint16_t records;
+    si5351_journalDiff(mask, 1);
+    if(SI5351_JOURNAL_HEADER + si5351_journalSize(mask, &records) > si5351Storage->sectorSize) {
+        return 1;
+    }
+
+    uint8_t next = (si5351JournalSector == SI5351_JOURNAL_NO_SECTOR) ? 0 : (si5351JournalSector + 1) % si5351Storage->sectors;
+    uint32_t seq = si5351JournalSeq + 1;
+    uint8_t header[SI5351_JOURNAL_HEADER] = {
+        SI5351_JOURNAL_MAGIC0, SI5351_JOURNAL_MAGIC1,
+        (uint8_t)seq, (uint8_t)(seq >> 8), (uint8_t)(seq >> 16), (uint8_t)(seq >> 24),
+        0xFF, 0
+    };
+    header[7] = si5351_crc8(0, header, 6);
+    uint32_t base = next * si5351Storage->sectorSize;
+    uint8_t complete = 0x00;
+
+    uint8_t oldSector = si5351JournalSector;
+    uint32_t oldOffset = si5351JournalOffset;
+    si5351JournalOffset = SI5351_JOURNAL_HEADER;
+    if((si5351Storage->erase(next) != 0) ||
+       (si5351Storage->write(base, header, sizeof(header)) != 0) ||
+       (si5351_journalAppend(mask, next) != 0) ||
+       (si5351Storage->write(base + SI5351_JOURNAL_COMPLETE, &complete, 1) != 0)) {
+        // The previous snapshot still counts, it can't be appended to if it was torn
+        si5351JournalSector = oldSector;
+        si5351JournalOffset = oldOffset;
+        return 1;
+    }
+    si5351JournalStats.bytesWritten += sizeof(header);
+
+    si5351JournalSector = next;
+    si5351JournalSeq = seq;
+    si5351JournalDirty = 0;
+    si5351JournalStats.compactions++;
+    memset(si5351JournalValid, 0, sizeof(si5351JournalValid));
+    si5351_journalTake(mask);
+    return 0;
+}
+
+/**
+ * @brief Appends the registers changed since the last call, compacts the journal
+ * when the sector is full.
+ *
+ * @return int Returns 0 on success, 1 on storage errors, 2 if no storage is attached.
+ */
+int si5351_SaveJournal(void) {
+    if(si5351Storage == NULL) {
+        return 2;
+    }
+    uint8_t mask[256/8];
+    uint16_t records;
+    if(!si5351_journalDiff(mask, 0)) {
+        return 0;
+    }
+    // A save has to be one record to be replayed as a whole
+    uint32_t bytes = si5351_journalSize(mask, &records);
+    if((si5351JournalSector == SI5351_JOURNAL_NO_SECTOR) || si5351JournalDirty || (records > 1) ||
+       (si5351JournalOffset + bytes > si5351Storage->sectorSize)) {
+        return si5351_CompactJournal();
+    }
+    if(si5351_journalAppend(mask, si5351JournalSector) != 0) {
+        return 1;
+    }
+    si5351JournalStats.records++;
+    si5351_journalTake(mask);
+    return 0;
+}
+
+/**
+ * @brief Copies the journal statistics
+ *
+ * @param stats
+ */
+void si5351_GetJournalStats(si5351JournalStats_t* stats) {
+    *stats = si5351JournalStats;
+}
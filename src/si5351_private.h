@@ -0,0 +1,167 @@
+// vim: set ai et ts=4 sw=4:
+// Driver internals shared by the si5351*.cpp files, not a part of the public interface.
+#ifndef _SI5351_PRIVATE_H_
+#define _SI5351_PRIVATE_H_
+
+#include <si5351.h>
+
+#define SI5351_ADDRESS 0x60
+#define I2C_FREQUENCY 100000U
+
+// Private procedures.
+uint8_t si5351_write(uint8_t reg, uint8_t data);
+uint8_t si5351_transmit(uint8_t reg, const uint8_t* data, uint8_t len);
+uint8_t si5351_replay(void);
+uint8_t si5351_read(uint8_t reg, uint8_t* data, uint8_t len);
+uint8_t si5351_chipLostState(void);
+uint8_t si5351_shadowValid(uint8_t reg);
+uint8_t si5351_waitSCL(uint8_t scl);
+void si5351_beginWire(void);
+void si5351_publish(void);
+uint32_t si5351_outputFreq(si5351PLLConfig_t* pll, si5351OutputConfig_t* out);
+uint8_t si5351_writeBurst(uint8_t reg, const uint8_t* data, uint8_t len);
+uint8_t si5351_writeMasked(uint8_t baseaddr, const uint8_t* data, uint8_t mask);
+uint8_t si5351_maskBytes(uint8_t mask);
+uint8_t si5351_maskBit(const uint8_t* mask, int reg);
+uint32_t si5351_writeRuns(const uint8_t* mask, uint8_t write, uint8_t* failed);
+void si5351_encodeBulk(int32_t P1, int32_t P2, int32_t P3, uint8_t divBy4, si5351RDiv_t rdiv, uint8_t* regs);
+void si5351_encodePLL(si5351PLLConfig_t* conf, uint8_t* regs);
+uint8_t si5351_encodeOutput(si5351OutputConfig_t* conf, uint8_t* regs);
+void si5351_decodeBulk(const uint8_t* regs, int32_t* a, int32_t* b, int32_t* c, si5351RDiv_t* rdiv);
+uint8_t si5351_shadowDiff(uint8_t baseaddr, const uint8_t* data);
+uint8_t si5351_writeChanged(uint8_t reg, uint8_t data);
+uint8_t si5351_shareMS0(uint8_t output, si5351PLL_t pll, si5351DriveStrength_t driveStrength, const uint8_t* ms, uint8_t integerMode, uint8_t phaseOffset);
+uint8_t si5351_unshareMS0(si5351PLL_t pll, const uint8_t* ms, uint8_t phaseOffset);
+uint8_t si5351_stage(uint8_t reg, const uint8_t* data, uint8_t len);
+
+// See http://www.silabs.com/Support%20Documents/TechnicalDocs/AN619.pdf
+enum {
+    SI5351_REGISTER_0_DEVICE_STATUS                       = 0,
+    SI5351_REGISTER_1_INTERRUPT_STATUS_STICKY             = 1,
+    SI5351_REGISTER_2_INTERRUPT_STATUS_MASK               = 2,
+    SI5351_REGISTER_3_OUTPUT_ENABLE_CONTROL               = 3,
+    SI5351_REGISTER_9_OEB_PIN_ENABLE_CONTROL              = 9,
+    SI5351_REGISTER_15_PLL_INPUT_SOURCE                   = 15,
+    SI5351_REGISTER_16_CLK0_CONTROL                       = 16,
+    SI5351_REGISTER_17_CLK1_CONTROL                       = 17,
+    SI5351_REGISTER_18_CLK2_CONTROL                       = 18,
+    SI5351_REGISTER_19_CLK3_CONTROL                       = 19,
+    SI5351_REGISTER_20_CLK4_CONTROL                       = 20,
+    SI5351_REGISTER_21_CLK5_CONTROL                       = 21,
+    SI5351_REGISTER_22_CLK6_CONTROL                       = 22,
+    SI5351_REGISTER_23_CLK7_CONTROL                       = 23,
+    SI5351_REGISTER_24_CLK3_0_DISABLE_STATE               = 24,
+    SI5351_REGISTER_25_CLK7_4_DISABLE_STATE               = 25,
+    SI5351_REGISTER_42_MULTISYNTH0_PARAMETERS_1           = 42,
+    SI5351_REGISTER_43_MULTISYNTH0_PARAMETERS_2           = 43,
+    SI5351_REGISTER_44_MULTISYNTH0_PARAMETERS_3           = 44,
+    SI5351_REGISTER_45_MULTISYNTH0_PARAMETERS_4           = 45,
+    SI5351_REGISTER_46_MULTISYNTH0_PARAMETERS_5           = 46,
+    SI5351_REGISTER_47_MULTISYNTH0_PARAMETERS_6           = 47,
+    SI5351_REGISTER_48_MULTISYNTH0_PARAMETERS_7           = 48,
+    SI5351_REGISTER_49_MULTISYNTH0_PARAMETERS_8           = 49,
+    SI5351_REGISTER_50_MULTISYNTH1_PARAMETERS_1           = 50,
+    SI5351_REGISTER_51_MULTISYNTH1_PARAMETERS_2           = 51,
+    SI5351_REGISTER_52_MULTISYNTH1_PARAMETERS_3           = 52,
+    SI5351_REGISTER_53_MULTISYNTH1_PARAMETERS_4           = 53,
+    SI5351_REGISTER_54_MULTISYNTH1_PARAMETERS_5           = 54,
+    SI5351_REGISTER_55_MULTISYNTH1_PARAMETERS_6           = 55,
+    SI5351_REGISTER_56_MULTISYNTH1_PARAMETERS_7           = 56,
+    SI5351_REGISTER_57_MULTISYNTH1_PARAMETERS_8           = 57,
+    SI5351_REGISTER_58_MULTISYNTH2_PARAMETERS_1           = 58,
+    SI5351_REGISTER_59_MULTISYNTH2_PARAMETERS_2           = 59,
+    SI5351_REGISTER_60_MULTISYNTH2_PARAMETERS_3           = 60,
+    SI5351_REGISTER_61_MULTISYNTH2_PARAMETERS_4           = 61,
+    SI5351_REGISTER_62_MULTISYNTH2_PARAMETERS_5           = 62,
+    SI5351_REGISTER_63_MULTISYNTH2_PARAMETERS_6           = 63,
+    SI5351_REGISTER_64_MULTISYNTH2_PARAMETERS_7           = 64,
+    SI5351_REGISTER_65_MULTISYNTH2_PARAMETERS_8           = 65,
+    SI5351_REGISTER_66_MULTISYNTH3_PARAMETERS_1           = 66,
+    SI5351_REGISTER_67_MULTISYNTH3_PARAMETERS_2           = 67,
+    SI5351_REGISTER_68_MULTISYNTH3_PARAMETERS_3           = 68,
+    SI5351_REGISTER_69_MULTISYNTH3_PARAMETERS_4           = 69,
+    SI5351_REGISTER_70_MULTISYNTH3_PARAMETERS_5           = 70,
+    SI5351_REGISTER_71_MULTISYNTH3_PARAMETERS_6           = 71,
+    SI5351_REGISTER_72_MULTISYNTH3_PARAMETERS_7           = 72,
+    SI5351_REGISTER_73_MULTISYNTH3_PARAMETERS_8           = 73,
+    SI5351_REGISTER_74_MULTISYNTH4_PARAMETERS_1           = 74,
+    SI5351_REGISTER_75_MULTISYNTH4_PARAMETERS_2           = 75,
+    SI5351_REGISTER_76_MULTISYNTH4_PARAMETERS_3           = 76,
+    SI5351_REGISTER_77_MULTISYNTH4_PARAMETERS_4           = 77,
+    SI5351_REGISTER_78_MULTISYNTH4_PARAMETERS_5           = 78,
+    SI5351_REGISTER_79_MULTISYNTH4_PARAMETERS_6           = 79,
+    SI5351_REGISTER_80_MULTISYNTH4_PARAMETERS_7           = 80,
+    SI5351_REGISTER_81_MULTISYNTH4_PARAMETERS_8           = 81,
+    SI5351_REGISTER_82_MULTISYNTH5_PARAMETERS_1           = 82,
+    SI5351_REGISTER_83_MULTISYNTH5_PARAMETERS_2           = 83,
+    SI5351_REGISTER_84_MULTISYNTH5_PARAMETERS_3           = 84,
+    SI5351_REGISTER_85_MULTISYNTH5_PARAMETERS_4           = 85,
+    SI5351_REGISTER_86_MULTISYNTH5_PARAMETERS_5           = 86,
+    SI5351_REGISTER_87_MULTISYNTH5_PARAMETERS_6           = 87,
+    SI5351_REGISTER_88_MULTISYNTH5_PARAMETERS_7           = 88,
+    SI5351_REGISTER_89_MULTISYNTH5_PARAMETERS_8           = 89,
+    SI5351_REGISTER_90_MULTISYNTH6_PARAMETERS             = 90,
+    SI5351_REGISTER_91_MULTISYNTH7_PARAMETERS             = 91,
+    SI5351_REGISTER_92_CLOCK_6_7_OUTPUT_DIVIDER           = 92,
+    SI5351_REGISTER_162_VCXO_PARAMETERS_LOW               = 162,
+    SI5351_REGISTER_163_VCXO_PARAMETERS_MID               = 163,
+    SI5351_REGISTER_164_VCXO_PARAMETERS_HIGH              = 164,
+    SI5351_REGISTER_165_CLK0_INITIAL_PHASE_OFFSET         = 165,
+    SI5351_REGISTER_166_CLK1_INITIAL_PHASE_OFFSET         = 166,
+    SI5351_REGISTER_167_CLK2_INITIAL_PHASE_OFFSET         = 167,
+    SI5351_REGISTER_168_CLK3_INITIAL_PHASE_OFFSET         = 168,
+    SI5351_REGISTER_169_CLK4_INITIAL_PHASE_OFFSET         = 169,
+    SI5351_REGISTER_170_CLK5_INITIAL_PHASE_OFFSET         = 170,
+    SI5351_REGISTER_177_PLL_RESET                         = 177,
+    SI5351_REGISTER_183_CRYSTAL_INTERNAL_LOAD_CAPACITANCE = 183
+};
+
+typedef enum {
+    SI5351_CRYSTAL_LOAD_6PF  = (1<<6),
+    SI5351_CRYSTAL_LOAD_8PF  = (2<<6),
+    SI5351_CRYSTAL_LOAD_10PF = (3<<6)
+} si5351CrystalLoad_t;
+
+// Output configuration as set up so far, published by si5351_publish()
+typedef struct {
+    uint8_t valid;
+    si5351PLL_t pll;
+    si5351DriveStrength_t driveStrength;
+    si5351OutputConfig_t conf;             // for the frequency only, see si5351_decodeBulk()
+    uint8_t ms[8];                          // MS register values, the output is re-programmed from these
+    uint8_t intMode;
+    uint8_t phaseOffset;
+    uint8_t sharesMS0;      // CLK1 or CLK2 routed from MS0, see si5351_shareMS0()
+} si5351OutputSetup_t;
+
+extern int32_t si5351Correction;
+extern uint8_t si5351Shadow[256];
+extern uint8_t si5351ShadowValid[256/8];
+extern si5351PLLConfig_t si5351PLLSetup[2];
+extern uint8_t si5351PLLSetupValid[2];
+extern si5351OutputSetup_t si5351OutputSetup[3];
+extern si5351BusStats_t si5351BusStats;
+extern uint8_t si5351Staging;
+extern uint8_t si5351Enabled;
+extern uint32_t si5351PLLResets;
+extern uint32_t si5351Bytes;
+
+// Configuration a commit can go back to, see si5351_BeginCommit()
+typedef struct {
+    uint8_t shadow[256];
+    uint8_t shadowValid[256/8];
+    si5351PLLConfig_t pllSetup[2];
+    uint8_t pllSetupValid[2];
+    si5351OutputSetup_t outputSetup[3];
+    uint8_t enabled;
+    int32_t vcxoOffset;
+    int32_t vcxoCenter;
+    uint16_t vcxoApr;
+    uint8_t vcxoOutput;
+} si5351State_t;
+
+void si5351_saveState(si5351State_t* state);
+void si5351_restoreState(const si5351State_t* state);
+void si5351_adoptShadow(void);
+
+#endif
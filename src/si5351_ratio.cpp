@@ -0,0 +1,185 @@
+// vim: set ai et ts=4 sw=4:
+
+#include <Arduino.h>
+#include <si5351.h>
+#include "si5351_private.h"
+
+// Limits of the fractional dividers, see AN619
+#define SI5351_RATIO_MAX_DENOM 1048575
+#define SI5351_RATIO_MAX_MS 2048
+
+// PLL range used by the rest of the driver, N in [24, 36]
+#define SI5351_RATIO_PLL_MIN 600000000LL
+#define SI5351_RATIO_PLL_MAX 900000000LL
+
+// Upper bound of the search time for low frequencies, where many PLL
+// multipliers of Fclk fall into the PLL range
+#define SI5351_RATIO_MAX_CANDIDATES 512
+
+/**
+ * @brief Greatest common divisor
+ */
+static uint64_t si5351_gcd(uint64_t a, uint64_t b) {
+    while(b != 0) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/**
+ * @brief Best rational approximation p/q of num/den with q <= maxDenom
+ * (continued fraction convergents and the last semiconvergent).
+ *
+ * @param num < 2^33
+ * @param den < 2^31
+ * @param maxDenom
+ * @param p
+ * @param q
+ */
+static void si5351_bestRational(uint64_t num, uint64_t den, uint64_t maxDenom, uint64_t* p, uint64_t* q) {
+    uint64_t p0 = 0, q0 = 1, p1 = 1, q1 = 0;
+    uint64_t n = num, d = den;
+
+    while(d != 0) {
+        uint64_t a = n / d;
+        uint64_t q2 = q0 + a * q1;
+        if(q2 > maxDenom) {
+            // The semiconvergent with the largest allowed denominator is closer than
+            // the last convergent if k > a/2, for k = a/2 both have to be compared
+            uint64_t k = (maxDenom - q0) / q1;
+            uint64_t ps = p0 + k * p1, qs = q0 + k * q1;
+            uint8_t semi = (2 * k > a);
+            if(2 * k == a) {
+                uint64_t e1 = (p1 * den > num * q1) ? (p1 * den - num * q1) : (num * q1 - p1 * den);
+                uint64_t es = (ps * den > num * qs) ? (ps * den - num * qs) : (num * qs - ps * den);
+                // |num/den - ps/qs| < |num/den - p1/q1|
+                semi = (es * q1 < e1 * qs);
+            }
+            if(semi) {
+                p1 = ps;
+                q1 = qs;
+            }
+            break;
+        }
+        uint64_t p2 = p0 + a * p1;
+        p0 = p1;
+        q0 = q1;
+        p1 = p2;
+        q1 = q2;
+        uint64_t t = n - a * d;
+        n = d;
+        d = t;
+    }
+
+    *p = p1;
+    *q = q1;
+}
+
+/**
+ * @brief Finds PLL settings and MS dividers for outputs with exact frequency ratios.
+ *
+ * Output k gets Fclk * ratios[k].num / ratios[k].den. All outputs share one PLL
+ * running @ L * Fclk for an integer L, so MS_k * R_k = L * den_k / num_k is an
+ * exact fraction for every output and the ratios between outputs don't depend on
+ * the PLL settings at all. The PLL multiplier is the best fraction with a denominator
+ * <= 1048575 for L * Fclk / Fxtal, corrected by `correction`. Out of all L with
+ * valid dividers the one with the smallest error is used, the error is the same
+ * relative error for all outputs.
+ *
+ * @param Fclk base frequency, outputs are its exact multiples
+ * @param ratios count entries
+ * @param count 1..3
+ * @param pll_conf
+ * @param out_confs count entries, for si5351_SetupOutput() with the same PLL
+ * @return int Returns 0 on success, 1 on invalid arguments, 2 if no PLL multiplier
+ * gives valid dividers for all outputs.
+ */
+int si5351_CalcRatio(int32_t Fclk, const si5351Ratio_t* ratios, uint8_t count, si5351PLLConfig_t* pll_conf, si5351OutputConfig_t* out_confs) {
+    if((Fclk <= 0) || (ratios == NULL) || (count == 0) || (count > 3)) {
+        return 1;
+    }
+    for(uint8_t k = 0; k < count; k++) {
+        if((ratios[k].num == 0) || (ratios[k].den == 0)) {
+            return 1;
+        }
+    }
+
+    uint64_t lmin = (SI5351_RATIO_PLL_MIN + Fclk - 1) / Fclk;
+    uint64_t lmax = SI5351_RATIO_PLL_MAX / Fclk;
+    if(lmin == 0) {
+        lmin = 1;
+    }
+
+    // relative error of the best solution so far, in 2^-36 units
+    uint64_t bestError = UINT64_MAX;
+    uint32_t candidates = 0;
+    for(uint64_t L = lmin; (L <= lmax) && (candidates < SI5351_RATIO_MAX_CANDIDATES); L++) {
+        si5351OutputConfig_t confs[3];
+        uint8_t valid = 1;
+        for(uint8_t k = 0; (k < count) && valid; k++) {
+            // MS_k * R_k = P / Q
+            uint64_t P = L * ratios[k].den;
+            uint64_t Q = ratios[k].num;
+            uint64_t g = si5351_gcd(P, Q);
+            P /= g;
+            Q /= g;
+
+            uint8_t rdiv = 0;
+            while((P > Q * SI5351_RATIO_MAX_MS << rdiv) && (rdiv < 7)) {
+                rdiv++;
+            }
+            Q <<= rdiv;
+            g = si5351_gcd(P, Q);
+            P /= g;
+            Q /= g;
+
+            uint64_t div = P / Q;
+            uint64_t num = P % Q;
+            int integer4or6 = (num == 0) && ((div == 4) || (div == 6));
+            if((P > Q * SI5351_RATIO_MAX_MS) || (Q > SI5351_RATIO_MAX_DENOM) || ((div < 8) && !integer4or6)) {
+                valid = 0;
+                break;
+            }
+            confs[k].allowIntegerMode = 1;
+            confs[k].div = (int32_t)div;
+            confs[k].num = (int32_t)num;
+            confs[k].denom = (int32_t)Q;
+            confs[k].rdiv = (si5351RDiv_t)rdiv;
+        }
+        if(!valid) {
+            continue;
+        }
+        candidates++;
+
+        // N = L * Fclk / Fxtal, the chip runs (1 + correction * 10^-8) fast:
+        // N = L * Fclk * 10^8 / (Fxtal * (10^8 + correction)) = 4 * L * Fclk / (10^8 + correction)
+        uint64_t nNum = 4 * L * (uint64_t)Fclk;
+        uint64_t nDen = (uint64_t)(100000000LL + si5351Correction);
+        uint64_t p, q;
+        si5351_bestRational(nNum, nDen, SI5351_RATIO_MAX_DENOM, &p, &q);
+        uint64_t a = p / q;
+        if((a < 24) || (a > 36) || ((a == 36) && (p % q != 0))) {
+            continue;
+        }
+
+        // diff / (q * nDen) = |p/q - N| <= 1/q, i.e. diff <= nDen < 2^27
+        uint64_t diff = (p * nDen > q * nNum) ? (p * nDen - q * nNum) : (q * nNum - p * nDen);
+        uint64_t error = (diff << 36) / (q * nNum);
+        if(error < bestError) {
+            bestError = error;
+            pll_conf->mult = (int32_t)a;
+            pll_conf->num = (int32_t)(p % q);
+            pll_conf->denom = (int32_t)q;
+            for(uint8_t k = 0; k < count; k++) {
+                out_confs[k] = confs[k];
+            }
+            if(diff == 0) {
+                break;
+            }
+        }
+    }
+
+    return (bestError == UINT64_MAX) ? 2 : 0;
+}
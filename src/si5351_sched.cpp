@@ -0,0 +1,469 @@
+// vim: set ai et ts=4 sw=4:
+
+#include <Arduino.h>
+#include <si5351.h>
+#include "si5351_private.h"
+
+// Queue entries, shared by all classes
+#define SI5351_SCHED_JOBS 16
+
+// Registers per restore or readback burst: 10 bytes on the bus, 0.9 ms @ 100 kHz
+#define SI5351_SCHED_CHUNK 8
+
+// Data bytes of si5351_QueueWrite()
+#define SI5351_SCHED_MAX_WRITE 8
+
+typedef enum {
+    SI5351_JOB_FREE = 0,
+    SI5351_JOB_WRITE,
+    SI5351_JOB_ENABLE,
+    SI5351_JOB_IMAGE,
+    SI5351_JOB_RESTORE,
+    SI5351_JOB_READBACK,
+} si5351JobKind_t;
+
+// Restore goes through the same stages as si5351_replay()
+typedef enum {
+    SI5351_RESTORE_DISABLE = 0,
+    SI5351_RESTORE_REGISTERS,
+    SI5351_RESTORE_RESET,
+    SI5351_RESTORE_ENABLE,
+} si5351RestoreStage_t;
+
+typedef struct {
+    si5351JobKind_t kind;
+    si5351Priority_t priority;
+    uint32_t seq;                   // submission order
+    uint32_t submitMicros;
+    uint8_t started;                // made a step and isn't finished yet
+    uint16_t next;                  // RESTORE, READBACK: next register to look at
+    uint8_t stage;                  // RESTORE: si5351RestoreStage_t
+    uint8_t pllWritten;             // RESTORE: PLL registers were written
+    uint8_t reg;                    // WRITE: first register
+    uint8_t len;
+    uint8_t data[SI5351_SCHED_MAX_WRITE];
+    uint8_t output;                 // IMAGE
+    si5351PLL_t pll;
+    si5351DriveStrength_t driveStrength;
+    si5351RegImage_t image;
+} si5351Job_t;
+
+// Free slots belong to the submitters, taken ones to the bus task. Both
+// change the kind only under the lock.
+static si5351Job_t si5351Jobs[SI5351_SCHED_JOBS];
+static portMUX_TYPE si5351SchedMux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t si5351SchedSeq = 0;
+static si5351BusPolicy_t si5351BusPolicy = SI5351_BUS_PRIORITY;
+static si5351SchedStats_t si5351SchedStats;
+
+// Outputs switched by urgent si5351_QueueEnableOutputs() jobs, e.g. keyed ones. A restore
+// leaves them as they are and holds the other outputs disabled until it's done.
+static uint8_t si5351KeyedOutputs = 0;
+static uint8_t si5351HeldOutputs = 0;
+
+/**
+ * @brief Takes a free queue entry and fills the common fields
+ *
+ * @param kind
+ * @param priority
+ * @param job is copied into the queue
+ * @return int Returns 0 on success, 1 on invalid arguments, 2 if the queue is full.
+ */
+static int si5351_submit(si5351JobKind_t kind, si5351Priority_t priority, si5351Job_t* job) {
+    if((unsigned)priority >= SI5351_PRIORITIES) {
+        return 1;
+    }
+    job->kind = kind;
+    job->priority = priority;
+    job->started = 0;
+    job->next = 0;
+    job->stage = SI5351_RESTORE_DISABLE;
+    job->pllWritten = 0;
+
+    int result = 2;
+    portENTER_CRITICAL(&si5351SchedMux);
+    for(int i = 0; i < SI5351_SCHED_JOBS; i++) {
+        if(si5351Jobs[i].kind == SI5351_JOB_FREE) {
+            job->seq = si5351SchedSeq++;
+            job->submitMicros = micros();
+            si5351Jobs[i] = *job;
+            result = 0;
+            break;
+        }
+    }
+    if(result != 0) {
+        si5351SchedStats.rejected++;
+    }
+    portEXIT_CRITICAL(&si5351SchedMux);
+    return result;
+}
+
+/**
+ * @brief Queues a write of len registers starting from reg, done in one burst
+ *
+ * @param priority
+ * @param reg
+ * @param data
+ * @param len 1..8
+ * @return int Returns 0 on success, 1 on invalid arguments, 2 if the queue is full.
+ */
+int si5351_QueueWrite(si5351Priority_t priority, uint8_t reg, const uint8_t* data, uint8_t len) {
+    if((data == NULL) || (len == 0) || (len > SI5351_SCHED_MAX_WRITE) || (reg + len > 256)) {
+        return 1;
+    }
+    si5351Job_t job;
+    memset(&job, 0, sizeof(job));
+    job.reg = reg;
+    job.len = len;
+    memcpy(job.data, data, len);
+    return si5351_submit(SI5351_JOB_WRITE, priority, &job);
+}
+
+/**
+ * @brief Queues si5351_EnableOutputs(enabled)
+ *
+ * @param priority
+ * @param enabled
+ * @return int Returns 0 on success, 1 on invalid arguments, 2 if the queue is full.
+ */
+int si5351_QueueEnableOutputs(si5351Priority_t priority, uint8_t enabled) {
+    si5351Job_t job;
+    memset(&job, 0, sizeof(job));
+    job.data[0] = enabled;
+    return si5351_submit(SI5351_JOB_ENABLE, priority, &job);
+}
+
+/**
+ * @brief Queues si5351_SetupImage(), done in one step
+ *
+ * @param priority
+ * @param output
+ * @param pll
+ * @param driveStrength
+ * @param image is copied
+ * @return int Returns 0 on success, 1 on invalid arguments, 2 if the queue is full.
+ */
+int si5351_QueueImage(si5351Priority_t priority, uint8_t output, si5351PLL_t pll, si5351DriveStrength_t driveStrength, const si5351RegImage_t* image) {
+    if((output > 2) || (image == NULL)) {
+        return 1;
+    }
+    si5351Job_t job;
+    memset(&job, 0, sizeof(job));
+    job.output = output;
+    job.pll = pll;
+    job.driveStrength = driveStrength;
+    job.image = *image;
+    return si5351_submit(SI5351_JOB_IMAGE, priority, &job);
+}
+
+/**
+ * @brief Queues a write-back of all shadowed registers, like the replay after a chip
+ * reset: outputs are disabled, the registers are written in chunks, PLLs are reset and
+ * the outputs are enabled again. Jobs of higher classes run between the chunks. Outputs
+ * switched by urgent si5351_QueueEnableOutputs() jobs are not disabled, keying goes on.
+ *
+ * @param priority
+ * @return int Returns 0 on success, 1 on invalid arguments, 2 if the queue is full.
+ */
+int si5351_QueueRestore(si5351Priority_t priority) {
+    si5351Job_t job;
+    memset(&job, 0, sizeof(job));
+    return si5351_submit(SI5351_JOB_RESTORE, priority, &job);
+}
+
+/**
+ * @brief Queues a read of all shadowed registers in chunks, registers that differ
+ * from the shadow copy are counted in si5351SchedStats_t.readbackMismatches.
+ *
+ * @param priority
+ * @return int Returns 0 on success, 1 on invalid arguments, 2 if the queue is full.
+ */
+int si5351_QueueReadback(si5351Priority_t priority) {
+    si5351Job_t job;
+    memset(&job, 0, sizeof(job));
+    return si5351_submit(SI5351_JOB_READBACK, priority, &job);
+}
+
+/**
+ * @brief Finds the next run of shadowed registers, at most SI5351_SCHED_CHUNK long
+ *
+ * @param from first register to look at
+ * @param skip register to leave out, e.g. output enable for restore
+ * @param len length of the run, 0 if there are no registers left
+ * @return uint16_t first register of the run
+ */
+static uint16_t si5351_nextChunk(uint16_t from, uint8_t skip, uint8_t* len) {
+    uint16_t reg = from;
+    while((reg < 256) && ((reg == skip) || !si5351_shadowValid(reg))) {
+        reg++;
+    }
+    *len = 0;
+    while((reg + *len < 256) && (*len < SI5351_SCHED_CHUNK) &&
+          (reg + *len != skip) && si5351_shadowValid(reg + *len)) {
+        (*len)++;
+    }
+    return reg;
+}
+
+/**
+ * @brief Writes the output enable register with the held outputs disabled, the shadow
+ * copy keeps the value si5351_EnableOutputs() gave it
+ *
+ * @return uint8_t Returns 0 on success, != 0 otherwise.
+ */
+static uint8_t si5351_writeEnable(void) {
+    const uint8_t enable = SI5351_REGISTER_3_OUTPUT_ENABLE_CONTROL;
+    uint8_t shadow = si5351Shadow[enable];
+    uint8_t value = shadow | si5351HeldOutputs;
+    uint8_t status = si5351_writeBurst(enable, &value, 1);
+    si5351Shadow[enable] = shadow;
+    return status;
+}
+
+/**
+ * @brief Step of an output enable job
+ *
+ * @return uint8_t Returns 0 on success, != 0 otherwise.
+ */
+static uint8_t si5351_enableStep(si5351Job_t* job) {
+    uint8_t enabled = job->data[0];
+    if(job->priority == SI5351_PRIORITY_URGENT) {
+        si5351KeyedOutputs |= enabled ^ si5351Enabled;
+        si5351HeldOutputs &= ~si5351KeyedOutputs;
+    }
+    if(!si5351HeldOutputs) {
+        si5351_EnableOutputs(enabled);
+        return 0;
+    }
+
+    // A restore is running, the held outputs stay disabled until it's done
+    si5351Shadow[SI5351_REGISTER_3_OUTPUT_ENABLE_CONTROL] = ~enabled;
+    si5351Enabled = enabled;
+    uint8_t status = si5351_writeEnable();
+    si5351_publish();
+    return status;
+}
+
+/**
+ * @brief One burst of a restore job
+ *
+ * @return uint8_t Returns 1 when the job is done.
+ */
+static uint8_t si5351_restoreStep(si5351Job_t* job) {
+    const uint8_t enable = SI5351_REGISTER_3_OUTPUT_ENABLE_CONTROL;
+    uint8_t buf[SI5351_SCHED_CHUNK];
+    uint8_t len;
+    uint8_t status = 0;
+
+    switch(job->stage) {
+    case SI5351_RESTORE_DISABLE:
+        si5351HeldOutputs = ~si5351KeyedOutputs;
+        status = si5351_writeEnable();
+        job->stage = SI5351_RESTORE_REGISTERS;
+        break;
+    case SI5351_RESTORE_REGISTERS: {
+        uint16_t reg = si5351_nextChunk(job->next, enable, &len);
+        if(len != 0) {
+            memcpy(buf, &si5351Shadow[reg], len);
+            status = si5351_writeBurst((uint8_t)reg, buf, len);
+            if((reg <= 41) && (reg + len > 26)) {
+                job->pllWritten = 1;
+            }
+            job->next = reg + len;
+            break;
+        }
+        job->stage = SI5351_RESTORE_RESET;
+    }
+    // fall through
+    case SI5351_RESTORE_RESET:
+        job->stage = SI5351_RESTORE_ENABLE;
+        if(job->pllWritten) {
+            buf[0] = (1<<7) | (1<<5);
+            status = si5351_writeBurst(SI5351_REGISTER_177_PLL_RESET, buf, 1);
+            break;
+        }
+    // fall through
+    default:
+        si5351HeldOutputs = 0;
+        if(si5351_shadowValid(enable)) {
+            status = si5351_writeEnable();
+        }
+        job->stage = SI5351_RESTORE_ENABLE + 1;
+        break;
+    }
+
+    if(status != 0) {
+        si5351SchedStats.failedBursts++;
+    }
+    return job->stage > SI5351_RESTORE_ENABLE;
+}
+
+/**
+ * @brief One burst of a readback job
+ *
+ * @return uint8_t Returns 1 when the job is done.
+ */
+static uint8_t si5351_readbackStep(si5351Job_t* job) {
+    uint8_t buf[SI5351_SCHED_CHUNK];
+    uint8_t len;
+    // PLL reset reads back as 0, it's not in the shadow copy anyway
+    uint16_t reg = si5351_nextChunk(job->next, SI5351_REGISTER_177_PLL_RESET, &len);
+    if(len == 0) {
+        return 1;
+    }
+    job->next = reg + len;
+
+    if(si5351_read((uint8_t)reg, buf, len) != 0) {
+        si5351SchedStats.failedBursts++;
+    } else {
+        for(uint8_t i = 0; i < len; i++) {
+            if(buf[i] != si5351Shadow[reg + i]) {
+                si5351SchedStats.readbackMismatches++;
+            }
+        }
+    }
+    // Done without another step if nothing is left
+    si5351_nextChunk(job->next, SI5351_REGISTER_177_PLL_RESET, &len);
+    return len == 0;
+}
+
+/**
+ * @brief Does one step of the job
+ *
+ * @return uint8_t Returns 1 when the job is done.
+ */
+static uint8_t si5351_step(si5351Job_t* job) {
+    uint8_t done = 1;
+    uint8_t failed = 0;
+
+    switch(job->kind) {
+    case SI5351_JOB_WRITE:
+        failed = si5351_writeBurst(job->reg, job->data, job->len) != 0;
+        break;
+    case SI5351_JOB_ENABLE:
+        failed = si5351_enableStep(job) != 0;
+        break;
+    case SI5351_JOB_IMAGE:
+        failed = si5351_SetupImage(job->output, job->pll, job->driveStrength, &job->image) != 0;
+        break;
+    case SI5351_JOB_RESTORE:
+        done = si5351_restoreStep(job);
+        break;
+    case SI5351_JOB_READBACK:
+        done = si5351_readbackStep(job);
+        break;
+    default:
+        break;
+    }
+
+    if(failed) {
+        si5351SchedStats.failedBursts++;
+    }
+    return done;
+}
+
+/**
+ * @brief Picks the job for the next step
+ *
+ * @return int queue index, -1 if the queue is empty
+ */
+static int si5351_pick(void) {
+    int best = -1;
+    for(int i = 0; i < SI5351_SCHED_JOBS; i++) {
+        si5351Job_t* job = &si5351Jobs[i];
+        if(job->kind == SI5351_JOB_FREE) {
+            continue;
+        }
+        if((si5351BusPolicy == SI5351_BUS_FIFO) && job->started) {
+            return i;
+        }
+        if(best < 0) {
+            best = i;
+            continue;
+        }
+        si5351Job_t* other = &si5351Jobs[best];
+        int higher = (si5351BusPolicy == SI5351_BUS_PRIORITY) && (job->priority < other->priority);
+        int same = (si5351BusPolicy == SI5351_BUS_FIFO) || (job->priority == other->priority);
+        // seq wraps around after 2^32 jobs
+        if(higher || (same && ((int32_t)(job->seq - other->seq) < 0))) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Does one step of the queued work: a single burst, or one si5351_SetupImage().
+ * Call it from the task that owns the bus.
+ *
+ * @return uint8_t Returns 1 if a step was done, 0 if the queue is empty.
+ */
+uint8_t si5351_RunBus(void) {
+    portENTER_CRITICAL(&si5351SchedMux);
+    int index = si5351_pick();
+    for(int i = 0; (index >= 0) && (i < SI5351_SCHED_JOBS); i++) {
+        if((i != index) && (si5351Jobs[i].kind != SI5351_JOB_FREE) && si5351Jobs[i].started) {
+            si5351SchedStats.preemptions++;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&si5351SchedMux);
+    if(index < 0) {
+        return 0;
+    }
+
+    si5351Job_t* job = &si5351Jobs[index];
+    uint8_t done = si5351_step(job);
+
+    portENTER_CRITICAL(&si5351SchedMux);
+    if(done) {
+        uint32_t latency = micros() - job->submitMicros;
+        si5351ClassStats_t* stats = &si5351SchedStats.classes[job->priority];
+        int bucket = (latency < 2) ? 0 : 31 - __builtin_clz(latency);
+        if(bucket >= SI5351_LATENCY_BUCKETS) {
+            bucket = SI5351_LATENCY_BUCKETS - 1;
+        }
+        stats->histogram[bucket]++;
+        stats->completed++;
+        if(latency > stats->maxMicros) {
+            stats->maxMicros = latency;
+        }
+        job->kind = SI5351_JOB_FREE;
+    } else {
+        job->started = 1;
+    }
+    portEXIT_CRITICAL(&si5351SchedMux);
+    return 1;
+}
+
+/**
+ * @brief Selects how si5351_RunBus() picks jobs. SI5351_BUS_FIFO ignores the classes
+ * and runs every job to completion, e.g. for comparison.
+ *
+ * @param policy
+ */
+void si5351_SetBusPolicy(si5351BusPolicy_t policy) {
+    portENTER_CRITICAL(&si5351SchedMux);
+    si5351BusPolicy = policy;
+    portEXIT_CRITICAL(&si5351SchedMux);
+}
+
+/**
+ * @brief Copies the scheduler statistics
+ *
+ * @param stats
+ */
+void si5351_GetSchedStats(si5351SchedStats_t* stats) {
+    portENTER_CRITICAL(&si5351SchedMux);
+    *stats = si5351SchedStats;
+    portEXIT_CRITICAL(&si5351SchedMux);
+}
+
+/**
+ * @brief Clears the scheduler statistics, queued jobs are kept
+ */
+void si5351_ResetSchedStats(void) {
+    portENTER_CRITICAL(&si5351SchedMux);
+    memset(&si5351SchedStats, 0, sizeof(si5351SchedStats));
+    portEXIT_CRITICAL(&si5351SchedMux);
+}
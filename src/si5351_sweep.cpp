@@ -0,0 +1,189 @@
+// vim: set ai et ts=4 sw=4:
+
+#include <Arduino.h>
+#include <stdlib.h>
+#include <si5351.h>
+#include "si5351_private.h"
+
+// Planning weight of a PLL change in bus bytes. A reset glitches the output and
+// the PLL needs time to lock, a few extra MS bytes are always cheaper.
+#define SI5351_SWEEP_RESET_COST 1000
+
+// Limits si5351_PlanSweep() stack usage in SI5351_SWEEP_MONOTONIC_SEGMENTS mode
+#define SI5351_SWEEP_MAX_SEGMENTS 64
+
+/**
+ * @brief Orders sweep steps by frequency, equal frequencies keep the caller's order
+ */
+static int si5351_sweepCompare(const void* a, const void* b) {
+    const si5351SweepStep_t* x = (const si5351SweepStep_t*)a;
+    const si5351SweepStep_t* y = (const si5351SweepStep_t*)b;
+    if(x->Fclk != y->Fclk) {
+        return x->Fclk < y->Fclk ? -1 : 1;
+    }
+    return (int)x->index - (int)y->index;
+}
+
+/**
+ * @brief Finds the registers that change between two images and the bus bytes
+ * needed to write them.
+ *
+ * @param prev image on the chip, NULL if unknown
+ * @param next
+ * @param pllMask
+ * @param msMask
+ * @param controlChanged
+ * @return uint16_t bus bytes, including the PLL reset and, for the first step, the phase offset
+ */
+static uint16_t si5351_sweepDelta(const si5351RegImage_t* prev, const si5351RegImage_t* next,
+                                  uint8_t* pllMask, uint8_t* msMask, uint8_t* controlChanged) {
+    uint16_t bytes = 0;
+
+    *pllMask = 0;
+    *msMask = 0;
+    for(int i = 0; i < 8; i++) {
+        if(prev == NULL || prev->pll[i] != next->pll[i]) {
+            *pllMask |= (1 << i);
+        }
+        if(prev == NULL || prev->ms[i] != next->ms[i]) {
+            *msMask |= (1 << i);
+        }
+    }
+    *controlChanged = (prev == NULL) || (prev->intMode != next->intMode);
+
+    if(prev == NULL) {
+        // phase offset register
+        bytes += 3;
+    }
+    if(*controlChanged) {
+        bytes += 3;
+    }
+    bytes += si5351_maskBytes(*msMask);
+    if(*pllMask) {
+        // PLL registers and the reset
+        bytes += si5351_maskBytes(*pllMask) + 3;
+    }
+    return bytes;
+}
+
+/**
+ * @brief Planning cost of going from one step to another
+ */
+static uint32_t si5351_sweepCost(const si5351SweepStep_t* prev, const si5351SweepStep_t* next) {
+    uint8_t pllMask, msMask, controlChanged;
+    uint32_t cost = si5351_sweepDelta(&prev->image, &next->image, &pllMask, &msMask, &controlChanged);
+    if(pllMask) {
+        cost += SI5351_SWEEP_RESET_COST;
+    }
+    return cost;
+}
+
+/**
+ * @brief Reverses steps in [first, last] range
+ */
+static void si5351_sweepReverse(si5351SweepStep_t* steps, uint16_t first, uint16_t last) {
+    while(first < last) {
+        si5351SweepStep_t tmp = steps[first];
+        steps[first] = steps[last];
+        steps[last] = tmp;
+        first++;
+        last--;
+    }
+}
+
+/**
+ * @brief Calculates settings for a list of frequencies and orders them to minimize
+ * PLL resets and bus traffic, see si5351.h.
+ *
+ * @param freqs frequencies, see si5351_Calc() for the range
+ * @param segments segment of every frequency or NULL, used only with SI5351_SWEEP_MONOTONIC_SEGMENTS
+ * @param count
+ * @param order
+ * @param steps count entries, filled in the visit order
+ * @return int Returns 0 on success, 1 on invalid arguments, 2 if there are more
+ * than SI5351_SWEEP_MAX_SEGMENTS segments.
+ */
+int si5351_PlanSweep(const int32_t* freqs, const uint8_t* segments, uint16_t count, si5351SweepOrder_t order, si5351SweepStep_t* steps) {
+    if((freqs == NULL) || (steps == NULL) || (count == 0)) {
+        return 1;
+    }
+
+    // Segment boundaries: segment s is [starts[s], starts[s+1])
+    uint16_t starts[SI5351_SWEEP_MAX_SEGMENTS + 1];
+    uint16_t nsegments = 1;
+    starts[0] = 0;
+    if((order == SI5351_SWEEP_MONOTONIC_SEGMENTS) && (segments != NULL)) {
+        for(uint16_t i = 1; i < count; i++) {
+            if(segments[i] != segments[i-1]) {
+                if(nsegments == SI5351_SWEEP_MAX_SEGMENTS) {
+                    return 2;
+                }
+                starts[nsegments++] = i;
+            }
+        }
+    }
+    starts[nsegments] = count;
+
+    for(uint16_t i = 0; i < count; i++) {
+        si5351SweepStep_t* step = &steps[i];
+        step->index = i;
+        step->Fclk = freqs[i];
+        si5351_Calc(freqs[i], &step->pll_conf, &step->out_conf);
+        si5351_encodePLL(&step->pll_conf, step->image.pll);
+        step->image.intMode = si5351_encodeOutput(&step->out_conf, step->image.ms);
+    }
+
+    // Below 81 MHz all frequencies share the 900 MHz PLL, sorting groups them
+    for(uint16_t s = 0; s < nsegments; s++) {
+        qsort(&steps[starts[s]], starts[s+1] - starts[s], sizeof(si5351SweepStep_t), si5351_sweepCompare);
+    }
+
+    // Costs within a segment don't depend on its direction, only the junctions
+    // do. Direction 0 is ascending, 1 is descending.
+    uint32_t cost[2] = { 0, 0 };
+    uint8_t from[SI5351_SWEEP_MAX_SEGMENTS][2];
+    for(uint16_t s = 1; s < nsegments; s++) {
+        uint16_t lo = starts[s], hi = starts[s+1] - 1;
+        uint16_t prevLo = starts[s-1], prevHi = starts[s] - 1;
+        uint32_t next[2];
+        for(int d = 0; d < 2; d++) {
+            const si5351SweepStep_t* first = &steps[d == 0 ? lo : hi];
+            uint32_t viaAsc = cost[0] + si5351_sweepCost(&steps[prevHi], first);
+            uint32_t viaDesc = cost[1] + si5351_sweepCost(&steps[prevLo], first);
+            from[s][d] = (viaDesc < viaAsc) ? 1 : 0;
+            next[d] = (viaDesc < viaAsc) ? viaDesc : viaAsc;
+        }
+        cost[0] = next[0];
+        cost[1] = next[1];
+    }
+
+    uint8_t direction = (cost[1] < cost[0]) ? 1 : 0;
+    for(uint16_t s = nsegments; s-- > 0; ) {
+        uint8_t prevDirection = (s > 0) ? from[s][direction] : 0;
+        if(direction == 1) {
+            si5351_sweepReverse(steps, starts[s], starts[s+1] - 1);
+        }
+        direction = prevDirection;
+    }
+
+    for(uint16_t i = 0; i < count; i++) {
+        si5351SweepStep_t* step = &steps[i];
+        step->bytes = si5351_sweepDelta(i == 0 ? NULL : &steps[i-1].image, &step->image,
+                                        &step->pllMask, &step->msMask, &step->controlChanged);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Programs a step planned by si5351_PlanSweep(), see si5351_SetupImage()
+ *
+ * @param output
+ * @param pll
+ * @param driveStrength
+ * @param step
+ * @return int Returns 0 on success, != 0 otherwise.
+ */
+int si5351_ApplySweepStep(uint8_t output, si5351PLL_t pll, si5351DriveStrength_t driveStrength, const si5351SweepStep_t* step) {
+    return si5351_SetupImage(output, pll, driveStrength, &step->image);
+}
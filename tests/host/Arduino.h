@@ -0,0 +1,35 @@
+// vim: set ai et ts=4 sw=4:
+// Host replacement for the Arduino core, just enough to build the driver.
+// Pins and time are simulated, see mock.h.
+#ifndef _ARDUINO_H_
+#define _ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define INPUT             0x01
+#define OUTPUT            0x03
+#define INPUT_PULLUP      0x05
+#define OUTPUT_OPEN_DRAIN 0x13
+
+#define HIGH 1
+#define LOW  0
+
+static const uint8_t SDA = 21;
+static const uint8_t SCL = 22;
+
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t val);
+unsigned long micros(void);
+void delayMicroseconds(uint32_t us);
+
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+void mock_EnterCritical(portMUX_TYPE* mux);
+void mock_ExitCritical(portMUX_TYPE* mux);
+#define portENTER_CRITICAL(mux) mock_EnterCritical(mux)
+#define portEXIT_CRITICAL(mux) mock_ExitCritical(mux)
+
+#endif
@@ -0,0 +1,30 @@
+// vim: set ai et ts=4 sw=4:
+// Host replacement for the Arduino Wire library, transfers go to mock.cpp.
+#ifndef _WIRE_H_
+#define _WIRE_H_
+
+#include <Arduino.h>
+
+class TwoWire {
+public:
+    bool begin();
+    bool begin(int sda, int scl, uint32_t frequency);
+    bool end();
+    void beginTransmission(uint8_t address);
+    size_t write(uint8_t data);
+    uint8_t endTransmission(bool sendStop = true);
+    uint8_t requestFrom(uint8_t address, uint8_t len, bool sendStop = true);
+    int available();
+    int read();
+
+private:
+    uint8_t txBuffer[64];
+    size_t txLen = 0;
+    uint8_t rxBuffer[256];
+    size_t rxLen = 0;
+    size_t rxPos = 0;
+};
+
+extern TwoWire Wire;
+
+#endif
@@ -0,0 +1,233 @@
+// vim: set ai et ts=4 sw=4:
+#include <Wire.h>
+#include <mutex>
+#include <stdio.h>
+#include "mock.h"
+#include "si5351_private.h"
+
+TwoWire Wire;
+
+uint8_t mockRegs[256];
+uint32_t mockPLLResets;
+std::vector<mockTransfer_t> mockLog;
+mockFault_t mockFault = NULL;
+mockSlave_t* mockSlave = NULL;
+uint32_t mockMicros;
+uint32_t mockWireBegins;
+uint32_t mockWireEnds;
+int mockFailures = 0;
+
+static uint8_t mockPinOut[256];
+static uint8_t mockReadPointer;
+static std::recursive_mutex mockCritical;
+
+void mock_ChipReset(void) {
+    memset(mockRegs, 0, sizeof(mockRegs));
+    mockRegs[0] = 0x80; // SYS_INIT until the first access
+    for(int reg = 16; reg <= 23; reg++) {
+        mockRegs[reg] = 0x0C;
+    }
+}
+
+void mock_Reset(void) {
+    mock_ChipReset();
+    mockRegs[0] = 0x00;
+    mockPLLResets = 0;
+    mockLog.clear();
+    mockFault = NULL;
+    mockSlave = NULL;
+    mockMicros = 0;
+    mockWireBegins = 0;
+    mockWireEnds = 0;
+    memset(mockPinOut, HIGH, sizeof(mockPinOut));
+}
+
+static int mock_Line(uint8_t pin) {
+    int level = mockPinOut[pin];
+    if(mockSlave != NULL) {
+        if(pin == SDA) level &= mockSlave->sda();
+        if(pin == SCL) level &= mockSlave->scl();
+    }
+    return level;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+    if(mode == INPUT || mode == INPUT_PULLUP) {
+        mockPinOut[pin] = HIGH;
+    }
+}
+
+int digitalRead(uint8_t pin) {
+    mockMicros += 1;
+    return mock_Line(pin);
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+    int sclBefore = mock_Line(SCL);
+    int sdaBefore = mock_Line(SDA);
+    mockPinOut[pin] = val ? HIGH : LOW;
+    if(mockSlave == NULL) {
+        return;
+    }
+    if(pin == SCL && !sclBefore && mock_Line(SCL)) {
+        mockSlave->clock(mock_Line(SDA));
+    }
+    if(pin == SDA && sclBefore && sdaBefore && !mock_Line(SDA)) {
+        mockSlave->start();
+    }
+    if(pin == SDA && sclBefore && !sdaBefore && mock_Line(SDA)) {
+        mockSlave->stop();
+    }
+}
+
+unsigned long micros(void) {
+    return mockMicros;
+}
+
+void delayMicroseconds(uint32_t us) {
+    mockMicros += us;
+}
+
+void mock_EnterCritical(portMUX_TYPE* mux) {
+    (void)mux;
+    mockCritical.lock();
+}
+
+void mock_ExitCritical(portMUX_TYPE* mux) {
+    (void)mux;
+    mockCritical.unlock();
+}
+
+bool TwoWire::begin() {
+    mockWireBegins++;
+    return true;
+}
+
+bool TwoWire::begin(int sda, int scl, uint32_t frequency) {
+    (void)sda;
+    (void)scl;
+    (void)frequency;
+    return begin();
+}
+
+bool TwoWire::end() {
+    mockWireEnds++;
+    return true;
+}
+
+void TwoWire::beginTransmission(uint8_t address) {
+    (void)address;
+    txLen = 0;
+}
+
+size_t TwoWire::write(uint8_t data) {
+    if(txLen >= sizeof(txBuffer)) {
+        return 0;
+    }
+    txBuffer[txLen++] = data;
+    return 1;
+}
+
+uint8_t TwoWire::endTransmission(bool sendStop) {
+    mockMicros += MOCK_BYTE_US * (txLen + 1);
+    if(txLen == 0) {
+        return 4;
+    }
+
+    uint8_t reg = txBuffer[0];
+    mockTransfer_t transfer;
+    transfer.reg = reg;
+    transfer.data.assign(txBuffer + 1, txBuffer + txLen);
+    transfer.accepted = 0;
+    transfer.status = 0;
+
+    if(mockSlave != NULL && (!mock_Line(SDA) || !mock_Line(SCL))) {
+        transfer.status = 5; // timeout, bus is held low
+    } else if(mockFault != NULL) {
+        transfer.status = mockFault(reg, txBuffer + 1, txLen - 1, &transfer.accepted);
+    }
+    if(transfer.status == 0) {
+        transfer.accepted = txLen - 1;
+    }
+
+    for(size_t i = 0; i < transfer.accepted; i++) {
+        uint8_t r = reg + i;
+        if(r == 177) {
+            mockPLLResets++;
+        } else if(r != 0) {
+            mockRegs[r] = txBuffer[1 + i];
+        }
+    }
+    mockReadPointer = reg;
+    (void)sendStop;
+
+    mockLog.push_back(transfer);
+    return transfer.status;
+}
+
+uint8_t TwoWire::requestFrom(uint8_t address, uint8_t len, bool sendStop) {
+    (void)address;
+    (void)sendStop;
+    mockMicros += MOCK_BYTE_US * (len + 1);
+    if(mockSlave != NULL && (!mock_Line(SDA) || !mock_Line(SCL))) {
+        rxLen = 0;
+        return 0;
+    }
+    for(uint8_t i = 0; i < len; i++) {
+        rxBuffer[i] = mockRegs[(uint8_t)(mockReadPointer + i)];
+    }
+    rxLen = len;
+    rxPos = 0;
+    return len;
+}
+
+int TwoWire::available() {
+    return rxLen - rxPos;
+}
+
+int TwoWire::read() {
+    if(rxPos >= rxLen) {
+        return -1;
+    }
+    return rxBuffer[rxPos++];
+}
+
+void check(int cond, const char* what) {
+    if(!cond) {
+        if(mockFailures < 10) printf("FAILED: %s\n", what);
+        mockFailures++;
+    }
+}
+
+void check(int cond, const char* what, int a, int b) {
+    if(!cond) {
+        if(mockFailures < 10) printf("FAILED: %s (%d, %d)\n", what, a, b);
+        mockFailures++;
+    }
+}
+
+int mock_ChipMatchesShadow(void) {
+    for(int reg = 0; reg < 256; reg++) {
+        if(si5351_shadowValid(reg) && (mockRegs[reg] != si5351Shadow[reg])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void mock_Decode(const uint8_t* regs, int64_t* n, int64_t* d, int* rdiv) {
+    int64_t P1 = ((int64_t)(regs[2] & 0x3) << 16) | (regs[3] << 8) | regs[4];
+    int64_t P2 = ((int64_t)(regs[5] & 0xF) << 16) | (regs[6] << 8) | regs[7];
+    int64_t P3 = ((int64_t)(regs[5] & 0xF0) << 12) | (regs[0] << 8) | regs[1];
+    if(rdiv != NULL) {
+        *rdiv = (regs[2] >> 4) & 0x7;
+    }
+    if(((regs[2] >> 2) & 0x3) == 0x3) {
+        *n = 4;
+        *d = 1;
+        return;
+    }
+    // P1 + 512 + P2/P3 = 128 * (a + b/c)
+    *n = (P1 + 512) * P3 + P2;
+    *d = 128 * P3;
+}
@@ -0,0 +1,61 @@
+// vim: set ai et ts=4 sw=4:
+// Simulated Si5351, I2C bus, pins and clock for the host tests.
+#ifndef _MOCK_H_
+#define _MOCK_H_
+
+#include <Arduino.h>
+#include <vector>
+
+#define MOCK_BYTE_US 90 // 9 clocks @ 100 kHz
+
+typedef struct {
+    uint8_t reg;
+    std::vector<uint8_t> data;
+    uint8_t status;   // Wire.endTransmission() result
+    size_t accepted;  // data bytes the chip took before NACK
+} mockTransfer_t;
+
+/*
+ * Called for every write transfer before it reaches the chip. Returns the
+ * Wire.endTransmission() status, on failure sets *accepted to the number of
+ * data bytes written before the NACK (0 by default).
+ */
+typedef uint8_t (*mockFault_t)(uint8_t reg, const uint8_t* data, size_t len, size_t* accepted);
+
+/*
+ * Line levels driven by the slave, 1 = released. Called on digitalRead() and
+ * on every SCL rising edge (clock), SDA falling edge while SCL is high (start)
+ * and SDA rising edge while SCL is high (stop).
+ */
+typedef struct {
+    int (*sda)(void);
+    int (*scl)(void);
+    void (*clock)(int sda);
+    void (*start)(void);
+    void (*stop)(void);
+} mockSlave_t;
+
+extern uint8_t mockRegs[256];          // chip registers
+extern uint32_t mockPLLResets;
+extern std::vector<mockTransfer_t> mockLog;
+extern mockFault_t mockFault;
+extern mockSlave_t* mockSlave;
+extern uint32_t mockMicros;
+extern uint32_t mockWireBegins;
+extern uint32_t mockWireEnds;
+
+// Clears the log, faults and time and sets registers to power-up defaults.
+void mock_Reset(void);
+// Chip power cycle: registers go back to power-up defaults.
+void mock_ChipReset(void);
+
+// Checks of the tests: every failure is counted, the first 10 are printed.
+extern int mockFailures;
+void check(int cond, const char* what);
+void check(int cond, const char* what, int a, int b = 0);
+// 1 if every register the driver wrote has that value on the chip.
+int mock_ChipMatchesShadow(void);
+// a + b/c = n/d from 8 PLL or MS registers, see AN619 section 3.2. rdiv can be NULL.
+void mock_Decode(const uint8_t* regs, int64_t* n, int64_t* d, int* rdiv);
+
+#endif
@@ -0,0 +1,175 @@
+// vim: set ai et ts=4 sw=4:
+// Bus recovery: drives si5351_write() and si5351_RecoverBus() through a mock
+// slave stuck in the middle of every bit of every byte, transient NACKs,
+// a chip reset and a slave that holds SCL low forever.
+
+#include <si5351.h>
+#include <stdio.h>
+#include "mock.h"
+
+// Slave interrupted in the middle of a transfer. In read mode it shifts out the rest
+// of `byte` MSB first and releases SDA when the master NACKs, in write mode it drives
+// the ACK bit low after the 8th clock. holdSCL stretches the clock forever.
+static struct {
+    int readMode;
+    uint8_t byte;
+    int bit; // 0..7 data bits, 8 is ACK slot
+    int holdSCL;
+    int released;
+    int stops;
+} slave;
+
+static int slaveSDA(void) {
+    if(slave.released) return 1;
+    if(slave.readMode) return slave.bit < 8 ? (slave.byte >> (7 - slave.bit)) & 1 : 1;
+    return slave.bit == 8 ? 0 : 1;
+}
+
+static int slaveSCL(void) {
+    return slave.holdSCL ? 0 : 1;
+}
+
+static void slaveClock(int sda) {
+    if(slave.released) return;
+    if(slave.bit == 8) {
+        if(!slave.readMode || sda) {
+            slave.released = 1; // NACK or the ACK was clocked out
+        }
+        slave.bit = 0;
+        return;
+    }
+    slave.bit++;
+}
+
+static void slaveStart(void) {
+    slave.released = 1; // waits for the address
+}
+
+static void slaveStop(void) {
+    slave.stops++;
+    slave.released = 1;
+}
+
+static mockSlave_t stuckSlave = { slaveSDA, slaveSCL, slaveClock, slaveStart, slaveStop };
+
+// si5351_Init() + CLK0 on PLL A and CLK2 on PLL B, the log is cleared afterwards
+static void setup(void) {
+    mock_Reset();
+    si5351_Init(0);
+    si5351_SetupCLK0(7000000, SI5351_DRIVE_STRENGTH_4MA);
+    si5351_SetupCLK2(10000000, SI5351_DRIVE_STRENGTH_4MA);
+    si5351_EnableOutputs(1<<0);
+    mockLog.clear();
+    mockPLLResets = 0;
+    mockWireEnds = 0;
+}
+
+static int outputsDropped(void) {
+    for(auto& t : mockLog) {
+        if(t.reg == 3 && t.accepted > 0 && t.data[0] == 0xFF) return 1;
+    }
+    return 0;
+}
+
+static int failCount;
+static uint8_t failFirst(uint8_t reg, const uint8_t* data, size_t len, size_t* accepted) {
+    (void)reg; (void)data; (void)accepted;
+    if(len == 0) {
+        return 0; // register reads go through
+    }
+    return failCount-- > 0 ? 3 : 0; // NACK on data
+}
+
+int main(void) {
+    si5351BusStats_t stats;
+
+    // A single NACK: retried, no recovery, no replay, no PLL reset
+    setup();
+    failCount = 1;
+    mockFault = failFirst;
+    si5351_EnableOutputs((1<<0) | (1<<2));
+    si5351_GetBusStats(&stats);
+    check(mockLog.size() == 2, "transient NACK costs one retry", mockLog.size());
+    check(mockWireEnds == 0, "transient NACK doesn't restart the controller");
+    check(mockPLLResets == 0 && !outputsDropped(), "transient NACK doesn't disturb outputs");
+    check(stats.busErrors == 1 && stats.replays == 0, "transient NACK stats");
+    check(mockRegs[3] == (uint8_t)~((1<<0) | (1<<2)), "transient NACK write lands");
+
+    // Repeated NACKs on a free bus: recovery finds no stuck line and the chip
+    // intact, the write is retried and as it still fails the registers are replayed.
+    setup();
+    failCount = 3;
+    mockFault = failFirst;
+    si5351_EnableOutputs(1<<2);
+    si5351_GetBusStats(&stats);
+    check(stats.stuckBus == 0 && stats.lastClockPulses == 0, "free bus is not clocked");
+    check(stats.replays == 1 && mock_ChipMatchesShadow(), "persistent failure replays", stats.replays);
+    mockFault = NULL;
+
+    // Stuck slave at every bit of every byte, the chip keeps its registers
+    int cases = 0;
+    uint32_t maxMicros = 0;
+    int maxPulses = 0;
+    for(int mode = 0; mode < 2; mode++) {
+        for(int byte = 0; byte < 256; byte++) {
+            for(int bit = 0; bit < 9; bit++) {
+                setup();
+                slave.readMode = mode;
+                slave.byte = byte;
+                slave.bit = bit;
+                slave.holdSCL = 0;
+                slave.released = 0;
+                slave.stops = 0;
+                mockSlave = &stuckSlave;
+                int stuck = !slaveSDA();
+
+                si5351_EnableOutputs((1<<0) | (1<<2));
+                si5351_GetBusStats(&stats);
+
+                check(mockRegs[3] == (uint8_t)~((1<<0) | (1<<2)), "write lands after recovery", byte, bit);
+                check(slave.released || !stuck, "slave released", byte, bit);
+                check(mockPLLResets == 0 && !outputsDropped(), "no replay for an intact chip", byte, bit);
+                if(stuck) {
+                    cases++;
+                    check(stats.stuckBus == 1 && slave.stops == 1, "stuck bus detected and stopped", byte, bit);
+                    check(stats.recoveries == 1 && stats.replays == 0, "recovery stats", byte, bit);
+                    if(stats.lastClockPulses > maxPulses) maxPulses = stats.lastClockPulses;
+                    if(stats.lastRecoveryMicros > maxMicros) maxMicros = stats.lastRecoveryMicros;
+                } else {
+                    check(mockLog.size() == 1, "free bus write goes through", byte, bit);
+                }
+            }
+        }
+    }
+    check(maxPulses <= 9, "at most 9 clock pulses", maxPulses);
+    printf("%d stuck-bus cases recovered, max %d clock pulses, max %u us\n", cases, maxPulses, maxMicros);
+
+    // Chip reset while the slave was stuck: registers are written back, PLLs reset once
+    setup();
+    mock_ChipReset();
+    slave = { 1, 0x00, 2, 0, 0, 0 };
+    mockSlave = &stuckSlave;
+    si5351_EnableOutputs(1<<0);
+    si5351_GetBusStats(&stats);
+    check(stats.replays == 1, "chip reset is replayed", stats.replays);
+    check(mock_ChipMatchesShadow(), "chip matches the shadow after replay");
+    check(mockPLLResets == 1, "PLLs reset once after replay", mockPLLResets);
+    printf("replay took %u us\n", stats.stageMicros[SI5351_RECOVERY_REPLAY]);
+
+    // SCL held low forever: recovery gives up within the stretch timeout
+    setup();
+    slave = { 1, 0x00, 3, 1, 0, 0 };
+    mockSlave = &stuckSlave;
+    check(si5351_RecoverBus() == 1, "stuck SCL is reported");
+    si5351_GetBusStats(&stats);
+    check(stats.lastRecoveryMicros < 2500, "stuck SCL gives up in time", stats.lastRecoveryMicros);
+    check(mockPLLResets == 0, "no replay on a dead bus");
+    printf("SCL stuck low reported after %u us\n", stats.lastRecoveryMicros);
+
+    if(mockFailures) {
+        printf("%d failures\n", mockFailures);
+        return 1;
+    }
+    printf("All done!\n");
+    return 0;
+}
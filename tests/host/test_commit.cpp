@@ -0,0 +1,219 @@
+// vim: set ai et ts=4 sw=4:
+// Commits: a commit that retunes a PLL and all outputs is sent with a NACK injected
+// in every burst after every number of accepted bytes. The chip must end up exactly in
+// the old or in the new configuration, through the cheaper of rollback and roll-forward.
+
+#include <si5351.h>
+#include <stdio.h>
+#include "mock.h"
+
+// Transfers faultFrom .. faultFrom + faultCount - 1 since the fault was armed fail,
+// the first one after faultAccepted data bytes
+static int transfers;
+static int faultFrom;
+static int faultCount;
+static size_t faultAccepted;
+
+static uint8_t fault(uint8_t reg, const uint8_t* data, size_t len, size_t* accepted) {
+    (void)reg;
+    (void)data;
+    int n = transfers++;
+    if((n >= faultFrom) && (n < faultFrom + faultCount)) {
+        *accepted = (n == faultFrom) ? (faultAccepted < len ? faultAccepted : len) : 0;
+        return 3; // NACK on data
+    }
+    return 0;
+}
+
+static void arm(int from, int count, size_t accepted) {
+    transfers = 0;
+    faultFrom = from;
+    faultCount = count;
+    faultAccepted = accepted;
+    mockFault = fault;
+}
+
+// Old configuration: CLK0 and CLK1 from PLL A, CLK2 from PLL B, CLK0 enabled
+static void setup(void) {
+    si5351PLLConfig_t pll_conf;
+    si5351OutputConfig_t out_conf;
+    mock_Reset();
+    si5351_Init(0);
+    si5351_Calc(7000000, &pll_conf, &out_conf);
+    si5351_SetupPLL(SI5351_PLL_A, &pll_conf);
+    si5351_SetupOutput(0, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_4MA, &out_conf, 0);
+    si5351_Calc(3500000, &pll_conf, &out_conf);
+    si5351_SetupOutput(1, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_4MA, &out_conf, 0);
+    si5351_Calc(10000000, &pll_conf, &out_conf);
+    si5351_SetupPLL(SI5351_PLL_B, &pll_conf);
+    si5351_SetupOutput(2, SI5351_PLL_B, SI5351_DRIVE_STRENGTH_2MA, &out_conf, 0);
+    si5351_EnableOutputs(1<<0);
+    mockLog.clear();
+}
+
+// New configuration: both PLLs and all outputs change
+static void stage(void) {
+    si5351PLLConfig_t pll_conf;
+    si5351OutputConfig_t out_conf;
+    si5351_BeginCommit();
+    si5351_CalcIQ(14074000, &pll_conf, &out_conf);
+    si5351_SetupPLL(SI5351_PLL_A, &pll_conf);
+    si5351_SetupOutput(0, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_8MA, &out_conf, 0);
+    si5351_SetupOutput(1, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_8MA, &out_conf, (uint8_t)out_conf.div);
+    si5351_Calc(120000000, &pll_conf, &out_conf);
+    si5351_SetupPLL(SI5351_PLL_B, &pll_conf);
+    si5351_SetupOutput(2, SI5351_PLL_B, SI5351_DRIVE_STRENGTH_6MA, &out_conf, 0);
+    si5351_EnableOutputs((1<<0) | (1<<1) | (1<<2));
+}
+
+static size_t logBytes(const std::vector<mockTransfer_t>& log, size_t from, size_t to) {
+    size_t bytes = 0;
+    for(size_t i = from; i < to; i++) {
+        bytes += 2 + log[i].data.size();
+    }
+    return bytes;
+}
+
+static int sameChip(const uint8_t* regs) {
+    return memcmp(regs + 1, mockRegs + 1, 255) == 0;
+}
+
+static int sameOutputs(const si5351Snapshot_t* a, const si5351Snapshot_t* b) {
+    for(int i = 0; i < 3; i++) {
+        if((a->outputs[i].freq != b->outputs[i].freq) || (a->outputs[i].enabled != b->outputs[i].enabled) ||
+           (a->outputs[i].phaseOffset != b->outputs[i].phaseOffset)) {
+            return 0;
+        }
+    }
+    return (a->pllFreq[0] == b->pllFreq[0]) && (a->pllFreq[1] == b->pllFreq[1]);
+}
+
+int main(void) {
+    // Reference: old and new chip registers and the bursts of the commit
+    setup();
+    uint8_t oldRegs[256];
+    memcpy(oldRegs, mockRegs, sizeof(oldRegs));
+    si5351Snapshot_t oldSnap, newSnap, snap;
+    si5351_GetSnapshot(&oldSnap);
+
+    stage();
+    check(mockLog.empty(), "nothing is sent while staging");
+    si5351_GetSnapshot(&snap);
+    check(snap.sequence == oldSnap.sequence, "nothing is published while staging");
+    check(si5351_EndCommit() == 0, "clean commit");
+    std::vector<mockTransfer_t> bursts = mockLog;
+    uint8_t newRegs[256];
+    memcpy(newRegs, mockRegs, sizeof(newRegs));
+    si5351_GetSnapshot(&newSnap);
+    check(!sameOutputs(&oldSnap, &newSnap), "commit changes the configuration");
+    printf("commit: %zu bursts, %zu bytes\n", bursts.size(), logBytes(bursts, 0, bursts.size()));
+
+    // Single NACK: retried right away
+    for(size_t k = 0; k < bursts.size(); k++) {
+        setup();
+        stage();
+        arm((int)k, 1, 0);
+        check(si5351_EndCommit() == 0, "transient error", (int)k);
+        check(sameChip(newRegs), "transient error: new configuration", (int)k);
+    }
+
+    // Every burst fails twice after every number of accepted bytes
+    int rollbacks = 0, rollForwards = 0, cases = 0;
+    size_t worstExtra = 0;
+    for(size_t k = 0; k < bursts.size(); k++) {
+        size_t forwardBytes = logBytes(bursts, k, bursts.size());
+        for(size_t accepted = 0; accepted <= bursts[k].data.size(); accepted++) {
+            setup();
+            uint32_t resetsBefore = mockPLLResets;
+            stage();
+            arm((int)k, 2, accepted);
+            int result = si5351_EndCommit();
+            cases++;
+
+            // Sent after the two failed attempts of burst k
+            size_t resolveStart = k + 2;
+            size_t resolveBytes = logBytes(mockLog, resolveStart, mockLog.size());
+            check(mock_ChipMatchesShadow(), "driver knows the chip state", (int)k, (int)accepted);
+            si5351_GetSnapshot(&snap);
+            if(result == 0) {
+                rollForwards++;
+                check(sameChip(newRegs), "rolled forward to the new configuration", (int)k, (int)accepted);
+                check(sameOutputs(&snap, &newSnap), "new configuration published", (int)k, (int)accepted);
+                check(resolveBytes == forwardBytes, "roll-forward sends the rest", (int)k, (int)accepted);
+            } else if(result == 3) {
+                rollbacks++;
+                check(sameChip(oldRegs), "rolled back to the old configuration", (int)k, (int)accepted);
+                check(sameOutputs(&snap, &oldSnap), "old configuration published", (int)k, (int)accepted);
+                check(resolveBytes < forwardBytes, "rollback is cheaper", (int)k, (int)accepted);
+
+                // PLL registers that reached the chip are followed by a PLL reset
+                uint32_t resetsAtFailure = resetsBefore;
+                int pllChanged = 0;
+                for(size_t i = 0; i <= k; i++) {
+                    const mockTransfer_t* t = &mockLog[i];
+                    for(size_t j = 0; j < t->accepted; j++) {
+                        int r = t->reg + (int)j;
+                        if(r == 177) resetsAtFailure++;
+                        if((r >= 26) && (r <= 41) && (t->data[j] != oldRegs[r])) pllChanged = 1;
+                    }
+                }
+                if(pllChanged) {
+                    check(mockPLLResets > resetsAtFailure, "PLL reset after rollback", (int)k, (int)accepted);
+                }
+            } else {
+                check(0, "commit resolved", (int)k, result);
+            }
+            size_t total = logBytes(mockLog, 0, mockLog.size());
+            size_t clean = logBytes(bursts, 0, bursts.size());
+            if(total > clean + worstExtra) {
+                worstExtra = total - clean;
+            }
+        }
+    }
+    printf("%d failure points: %d rollbacks, %d roll-forwards, at most %zu extra bytes\n",
+        cases, rollbacks, rollForwards, worstExtra);
+    check(rollbacks > 0 && rollForwards > 0, "both ways are used");
+
+    si5351BusStats_t stats;
+    si5351_GetBusStats(&stats);
+    check(stats.rollbacks + stats.rollForwards == 1, "resolution counted");
+
+    // The bus dies for good in the middle of the commit
+    for(size_t k = 0; k < bursts.size(); k++) {
+        setup();
+        stage();
+        arm((int)k, 1000000, 1);
+        check(si5351_EndCommit() == 1, "dead bus reported", (int)k);
+    }
+    mockFault = NULL;
+
+    // Too large: nothing is sent, the old configuration stays
+    setup();
+    si5351_BeginCommit();
+    for(int i = 0; i < 40; i++) {
+        si5351PLLConfig_t pll_conf;
+        si5351OutputConfig_t out_conf;
+        si5351_Calc(1000000 + 1000 * i, &pll_conf, &out_conf);
+        si5351_SetupOutput(i % 3, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_4MA, &out_conf, 0);
+    }
+    check(si5351_EndCommit() == 2, "too large commit");
+    check(mockLog.empty() && sameChip(oldRegs) && mock_ChipMatchesShadow(), "nothing sent");
+    si5351_GetSnapshot(&snap);
+    check(sameOutputs(&snap, &oldSnap), "old configuration kept");
+
+    // Aborted: nothing is sent, later calls write right away
+    setup();
+    stage();
+    si5351_AbortCommit();
+    check(mockLog.empty() && mock_ChipMatchesShadow(), "abort sends nothing");
+    si5351_EnableOutputs(1<<2);
+    check(mockRegs[3] == (uint8_t)~(1<<2), "writes go out after abort");
+    check(si5351_EndCommit() == 0, "no commit to end");
+
+    if(mockFailures) {
+        printf("%d failures\n", mockFailures);
+        return 1;
+    }
+    printf("All done!\n");
+    return 0;
+}
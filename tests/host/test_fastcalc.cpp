@@ -0,0 +1,163 @@
+// vim: set ai et ts=4 sw=4:
+// si5351_CalcFast() against si5351_Calc() for every integer frequency in
+// [8_000, 160_000_000]. Both results are decoded from the register values
+// into exact fractions, the fast one must be within 4 Hz of Fclk.
+
+#include <si5351.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "mock.h"
+
+#define BOUND_HZ 4
+
+void si5351_encodePLL(si5351PLLConfig_t* conf, uint8_t* regs);
+uint8_t si5351_encodeOutput(si5351OutputConfig_t* conf, uint8_t* regs);
+
+typedef __int128 int128_t;
+
+// Exact frequency num / den
+typedef struct {
+    int128_t num;
+    int128_t den;
+} freq_t;
+
+static freq_t imageFreq(const si5351RegImage_t* image) {
+    int64_t pn, pd, mn, md;
+    int prdiv, rdiv;
+    mock_Decode(image->pll, &pn, &pd, &prdiv);
+    mock_Decode(image->ms, &mn, &md, &rdiv);
+    freq_t f;
+    f.num = (int128_t)25000000 * pn * md;
+    f.den = ((int128_t)pd * mn) << rdiv;
+    return f;
+}
+
+static freq_t confFreq(const si5351PLLConfig_t* pll, const si5351OutputConfig_t* out) {
+    freq_t f;
+    f.num = (int128_t)25000000 * ((int64_t)pll->mult * pll->denom + pll->num) * out->denom;
+    f.den = ((int128_t)pll->denom * ((int64_t)out->div * out->denom + out->num)) << out->rdiv;
+    return f;
+}
+
+static double errorHz(freq_t f, int32_t Fclk) {
+    int128_t diff = f.num - (int128_t)Fclk * f.den;
+    return (double)diff / (double)f.den;
+}
+
+static int withinHz(freq_t f, int32_t Fclk, int32_t bound) {
+    int128_t diff = f.num - (int128_t)Fclk * f.den;
+    if(diff < 0) diff = -diff;
+    return diff <= (int128_t)bound * f.den;
+}
+
+int main(void) {
+    mock_Reset();
+    si5351_Init(0);
+
+    double maxFast = 0, maxCalc = 0;
+    int32_t worstFast = 0, worstCalc = 0;
+    int64_t sameRegime = 0;
+    for(int32_t Fclk = 8000; Fclk <= 160000000; Fclk++) {
+        si5351RegImage_t image;
+        si5351_CalcFast(Fclk, &image);
+        freq_t fast = imageFreq(&image);
+        if(!withinHz(fast, Fclk, BOUND_HZ)) {
+            printf("Fclk %d: fast error %.3f Hz\n", Fclk, errorHz(fast, Fclk));
+            check(0, "fast result within the bound");
+        }
+        double e = errorHz(fast, Fclk);
+        if(e < 0) e = -e;
+        if(e > maxFast) {
+            maxFast = e;
+            worstFast = Fclk;
+        }
+
+        si5351PLLConfig_t pll_conf;
+        si5351OutputConfig_t out_conf;
+        si5351_Calc(Fclk, &pll_conf, &out_conf);
+        double c = errorHz(confFreq(&pll_conf, &out_conf), Fclk);
+        if(c < 0) c = -c;
+        if(c > maxCalc) {
+            maxCalc = c;
+            worstCalc = Fclk;
+        }
+
+        // Same regime as the exact solver: the 900 MHz PLL or the same integer MS
+        int64_t pn, pd, mn, md;
+        int prdiv, rdiv;
+        mock_Decode(image.pll, &pn, &pd, &prdiv);
+        mock_Decode(image.ms, &mn, &md, &rdiv);
+        int fixedPLL = (pll_conf.mult == 36) && (pll_conf.num == 0);
+        if((rdiv == out_conf.rdiv) &&
+           (fixedPLL ? (pn == 36 * pd) : (out_conf.num == 0 && mn == out_conf.div * md))) {
+            sameRegime++;
+        }
+        if(image.intMode) {
+            check(mn % md == 0, "integer mode only for integer MS");
+        }
+    }
+    printf("fast: max error %.3f Hz @ %d\n", maxFast, worstFast);
+    printf("exact solver: max error %.3f Hz @ %d\n", maxCalc, worstCalc);
+    check(sameRegime == 160000000 - 8000 + 1, "fast path keeps the solver's regimes");
+
+    // Correction: the chip runs (1 + correction * 10^-8) fast, the result compensates it
+    const int32_t corrections[] = { -2000, -970, 970, 2000 };
+    for(size_t k = 0; k < sizeof(corrections)/sizeof(corrections[0]); k++) {
+        si5351_Init(corrections[k]);
+        for(int32_t Fclk = 8000; Fclk <= 160000000; Fclk += 997) {
+            si5351RegImage_t image;
+            si5351_CalcFast(Fclk, &image);
+            freq_t f = imageFreq(&image);
+            f.num = f.num * (100000000 + corrections[k]);
+            f.den = f.den * 100000000;
+            // plus the error of the linearized correction, < 1 ppb
+            check(withinHz(f, Fclk, BOUND_HZ + 1), "corrected result within the bound");
+        }
+    }
+    si5351_Init(0);
+
+    // Through the driver: the chip gets the image, the snapshot reports its frequency
+    const int32_t samples[] = { 8000, 999999, 1000000, 7074000, 80999999, 81000000, 145500000, 160000000 };
+    for(size_t k = 0; k < sizeof(samples)/sizeof(samples[0]); k++) {
+        si5351RegImage_t image;
+        si5351_CalcFast(samples[k], &image);
+        check(si5351_SetupImage(0, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_4MA, &image) == 0, "setup image");
+        check(memcmp(&mockRegs[26], image.pll, 8) == 0, "PLL registers reach the chip");
+        check(memcmp(&mockRegs[42], image.ms, 8) == 0, "MS registers reach the chip");
+        si5351Snapshot_t snap;
+        si5351_GetSnapshot(&snap);
+        check(llabs((long long)snap.outputs[0].freq - samples[k]) <= BOUND_HZ, "snapshot reports the frequency");
+    }
+
+    // Speed on the host, for reference only
+    volatile uint32_t sink = 0;
+    clock_t t0 = clock();
+    for(int32_t Fclk = 1000000; Fclk < 81000000; Fclk += 7) {
+        si5351RegImage_t image;
+        si5351_CalcFast(Fclk, &image);
+        sink += image.ms[7];
+    }
+    clock_t t1 = clock();
+    for(int32_t Fclk = 1000000; Fclk < 81000000; Fclk += 7) {
+        si5351PLLConfig_t pll_conf;
+        si5351OutputConfig_t out_conf;
+        si5351RegImage_t image;
+        si5351_Calc(Fclk, &pll_conf, &out_conf);
+        si5351_encodePLL(&pll_conf, image.pll);
+        image.intMode = si5351_encodeOutput(&out_conf, image.ms);
+        sink += image.ms[7];
+    }
+    clock_t t2 = clock();
+    // x86 divides in a few cycles, on the target 64-bit and often 32-bit divisions are library calls
+    printf("host: fast %.1f ns, exact %.1f ns per frequency\n",
+        (double)(t1 - t0) * 1e9 / CLOCKS_PER_SEC / (80000000 / 7),
+        (double)(t2 - t1) * 1e9 / CLOCKS_PER_SEC / (80000000 / 7));
+
+    if(mockFailures) {
+        printf("%d failures\n", mockFailures);
+        return 1;
+    }
+    printf("All done!\n");
+    return 0;
+}
@@ -0,0 +1,240 @@
+// vim: set ai et ts=4 sw=4:
+// Configuration journal: hops are saved to a simulated flash, the chip is power
+// cycled and the configuration replayed. Power is cut after every number of
+// programmed bytes, the replay must bring back exactly the last completed save.
+
+#include <si5351.h>
+#include <stdio.h>
+#include "mock.h"
+
+uint8_t si5351_shadowValid(uint8_t reg);
+
+#define MAX_SECTORS 4
+#define MAX_SECTOR_SIZE 4096
+
+static uint32_t rng;
+
+static uint32_t random32(void) {
+    rng = rng * 1664525 + 1013904223;
+    return rng;
+}
+
+// Simulated NOR flash: erase sets bytes to 0xFF, programming only clears bits.
+// After `budget` programmed bytes or erases the power is cut: the byte being
+// programmed keeps half of its bits, an erase stops halfway.
+static uint8_t flash[MAX_SECTORS * MAX_SECTOR_SIZE];
+static uint32_t erases[MAX_SECTORS];
+static uint32_t budget;
+static int powered;
+static int setBits;     // writes that would need an erase
+
+static int flashRead(uint32_t addr, uint8_t* data, uint32_t len) {
+    if(!powered) return 1;
+    mockMicros += 5 + len / 16; // command + address, then 20 MB/s
+    memcpy(data, &flash[addr], len);
+    return 0;
+}
+
+static int flashWrite(uint32_t addr, const uint8_t* data, uint32_t len) {
+    for(uint32_t i = 0; i < len; i++) {
+        if(!powered) return 1;
+        if(budget == 0) {
+            flash[addr + i] &= data[i] | 0xF0;
+            powered = 0;
+            return 1;
+        }
+        budget--;
+        if(data[i] & ~flash[addr + i]) setBits++;
+        flash[addr + i] &= data[i];
+    }
+    return 0;
+}
+
+static si5351Storage_t storage;
+
+static int flashErase(uint8_t sector) {
+    if(!powered) return 1;
+    uint8_t* bytes = &flash[sector * storage.sectorSize];
+    if(budget == 0) {
+        memset(bytes, 0xFF, storage.sectorSize / 2);
+        powered = 0;
+        return 1;
+    }
+    budget--;
+    memset(bytes, 0xFF, storage.sectorSize);
+    erases[sector]++;
+    return 0;
+}
+
+static void flashInit(uint32_t sectorSize, uint8_t sectors) {
+    storage.sectorSize = sectorSize;
+    storage.sectors = sectors;
+    storage.read = flashRead;
+    storage.write = flashWrite;
+    storage.erase = flashErase;
+    memset(flash, 0x5A, sizeof(flash));    // never erased
+    memset(erases, 0, sizeof(erases));
+    budget = UINT32_MAX;
+    powered = 1;
+    setBits = 0;
+}
+
+// Power cycle of chip and controller, then boot
+static int reboot(void) {
+    powered = 1;
+    budget = UINT32_MAX;
+    mock_Reset();
+    si5351_Init(0);
+    return si5351_LoadJournal(&storage);
+}
+
+static void configure(void) {
+    si5351RegImage_t image;
+    si5351_CalcFast(7074000, &image);
+    si5351_SetupImage(0, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_8MA, &image);
+    si5351_CalcFast(10000000, &image);
+    si5351_SetupImage(2, SI5351_PLL_B, SI5351_DRIVE_STRENGTH_4MA, &image);
+    si5351_EnableOutputs((1<<0) | (1<<2));
+}
+
+static void hop(int i) {
+    si5351RegImage_t image;
+    si5351_CalcFast(7000000 + random32() % 300000, &image);
+    si5351_SetupImage(0, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_8MA, &image);
+    if(i % 10 == 9) {
+        si5351_EnableOutputs((random32() & 1) ? (1<<0) | (1<<2) : (1<<2));
+    }
+}
+
+static int sameChip(const uint8_t* regs) {
+    return (memcmp(regs + 1, mockRegs + 1, 176) == 0) && (memcmp(regs + 178, mockRegs + 178, 78) == 0);
+}
+
+#define CUT_SAVES 200
+
+int main(void) {
+    si5351JournalStats_t stats;
+    si5351Snapshot_t before, after;
+
+    // Hops on a 4 x 4 KB partition
+    flashInit(MAX_SECTOR_SIZE, MAX_SECTORS);
+    rng = 12345;
+    check(reboot() == 2, "empty storage");
+    configure();
+    check(si5351_SaveJournal() == 0, "first save");
+    int saves = 3000;
+    for(int i = 0; i < saves; i++) {
+        hop(i);
+        check(si5351_SaveJournal() == 0, "save", i);
+    }
+    check(si5351_SaveJournal() == 0, "save without changes");
+    si5351_GetJournalStats(&stats);
+    check(stats.records + stats.compactions == (uint32_t)saves + 1, "one record or snapshot per save");
+    check(setBits == 0, "bytes are programmed once per erase");
+    uint32_t minErases = UINT32_MAX, maxErases = 0;
+    for(int s = 0; s < MAX_SECTORS; s++) {
+        if(erases[s] < minErases) minErases = erases[s];
+        if(erases[s] > maxErases) maxErases = erases[s];
+    }
+    printf("%d saves: %u deltas, %u snapshots, %.1f bytes per save, erases %u..%u per sector\n",
+        saves, stats.records, stats.compactions, (double)stats.bytesWritten / (saves + 1), minErases, maxErases);
+    check(stats.compactions >= 2 * MAX_SECTORS, "sectors are reused");
+    check(maxErases - minErases <= 1, "erases are spread over the sectors");
+
+    uint8_t regs[256];
+    memcpy(regs, mockRegs, sizeof(regs));
+    si5351_GetSnapshot(&before);
+    check(reboot() == 0, "load");
+    si5351_GetJournalStats(&stats);
+    check(sameChip(regs), "configuration restored");
+    check(mock_ChipMatchesShadow(), "driver knows the chip state");
+    si5351_GetSnapshot(&after);
+    for(int i = 0; i < 3; i++) {
+        check((after.outputs[i].freq == before.outputs[i].freq) && (after.outputs[i].enabled == before.outputs[i].enabled),
+            "output restored", i);
+    }
+    // One register per transfer for the same registers
+    uint32_t perRegister = 0;
+    for(int reg = 0; reg < 256; reg++) {
+        if((reg != 177) && si5351_shadowValid(reg)) {
+            perRegister += 3;
+        }
+    }
+    printf("replay: %u records, %u bus bytes (%u one by one), %u us\n",
+        stats.replayRecords, stats.restoreBytes, perRegister, stats.replayMicros);
+    check(stats.restoreBytes < perRegister / 2, "restore in bursts");
+    check(stats.replayMicros < stats.restoreBytes * MOCK_BYTE_US + 5000, "replay time is mostly the bus");
+
+    // Later hops go on from the replayed state
+    hop(0);
+    check(si5351_SaveJournal() == 0, "save after load");
+    memcpy(regs, mockRegs, sizeof(regs));
+    check(reboot() == 0 && sameChip(regs), "save after load restored");
+
+    // Power cut after every number of programmed bytes on a 4 x 512 B partition
+    static uint8_t states[CUT_SAVES][256];
+    flashInit(512, MAX_SECTORS);
+    reboot();
+    rng = 777;
+    configure();
+    for(int i = 0; i < CUT_SAVES; i++) {
+        if(i > 0) hop(i);
+        check(si5351_SaveJournal() == 0, "reference save", i);
+        memcpy(states[i], mockRegs, 256);
+    }
+    si5351_GetJournalStats(&stats);
+    uint32_t total = UINT32_MAX - budget;
+    printf("power cuts: %u points over %d saves, %u snapshots\n", total + 1, CUT_SAVES, stats.compactions);
+    check(stats.compactions >= MAX_SECTORS, "cuts hit compactions");
+
+    int torn = 0, lost = 0;
+    for(uint32_t cut = 0; cut <= total; cut++) {
+        flashInit(512, MAX_SECTORS);
+        reboot();
+        rng = 777;
+        budget = cut;
+        configure();
+        int last = -1;
+        for(int i = 0; i < CUT_SAVES; i++) {
+            if(i > 0) hop(i);
+            if(si5351_SaveJournal() == 0) {
+                check(powered, "save succeeds only with power", (int)cut, i);
+                last = i;
+            }
+        }
+        int result = reboot();
+        if(last < 0) {
+            check(result == 2, "nothing saved before the cut", (int)cut);
+            lost++;
+        } else {
+            check(result == 0, "load after cut", (int)cut, result);
+            check(sameChip(states[last]), "last completed save restored", (int)cut, last);
+            check(mock_ChipMatchesShadow(), "driver knows the chip state after cut", (int)cut);
+            if(last < CUT_SAVES - 1) torn++;
+        }
+
+        // The journal goes on after the torn write
+        hop(0);
+        check(si5351_SaveJournal() == 0, "save after cut", (int)cut);
+        memcpy(regs, mockRegs, sizeof(regs));
+        check(reboot() == 0 && sameChip(regs), "save after cut restored", (int)cut);
+        check(setBits == 0, "no programming over programmed bytes", (int)cut);
+    }
+    printf("%d cuts lost a save, %d before the first one\n", torn, lost);
+
+    // Storage errors and missing storage
+    si5351Storage_t small = storage;
+    small.sectors = 1;
+    mock_Reset();
+    si5351_Init(0);
+    check(si5351_LoadJournal(&small) == 3, "one sector is too few");
+    check(si5351_SaveJournal() == 2, "no storage");
+    check(si5351_CompactJournal() == 2, "no storage to compact");
+
+    if(mockFailures) {
+        printf("%d failures\n", mockFailures);
+        return 1;
+    }
+    printf("All done!\n");
+    return 0;
+}
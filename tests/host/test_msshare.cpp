@@ -0,0 +1,195 @@
+// vim: set ai et ts=4 sw=4:
+// MultiSynth sharing: outputs set up like CLK0 run from MS0, every output is
+// modelled from the simulated chip registers (source select, PLL, MS, R divider)
+// and must give exactly the frequency it was set up for, before and after un-sharing.
+
+#include <si5351.h>
+#include <stdio.h>
+#include "mock.h"
+
+typedef __int128 int128_t;
+
+// Exact frequency num / den and what produces it
+typedef struct {
+    int128_t num;
+    int128_t den;
+    int ms;       // MultiSynth the output runs from
+    int phase;    // phase offset of that MultiSynth
+} clk_t;
+
+// CLKx as the chip produces it, see AN619 figure 1 and registers 16..18
+static clk_t chipClock(int output) {
+    clk_t c;
+    uint8_t control = mockRegs[16 + output];
+    int src = (control >> 2) & 0x3;
+    check(src == 0x3 || (src == 0x2 && output > 0), "output runs from a MultiSynth");
+    c.ms = (src == 0x2) ? 0 : output;
+    c.phase = mockRegs[165 + c.ms];
+
+    // MSx_SRC is bit 5 of the CLK control register of that MultiSynth
+    int pll = (mockRegs[16 + c.ms] >> 5) & 1;
+    int64_t pn, pd, mn, md;
+    mock_Decode(&mockRegs[pll ? 34 : 26], &pn, &pd, NULL);
+    mock_Decode(&mockRegs[42 + 8 * c.ms], &mn, &md, NULL);
+    // R divider belongs to the output
+    int rdiv = (mockRegs[42 + 8 * output + 2] >> 4) & 0x7;
+
+    c.num = (int128_t)25000000 * pn * md;
+    c.den = ((int128_t)pd * mn) << rdiv;
+    return c;
+}
+
+static int sameFreq(clk_t a, clk_t b) {
+    return a.num * b.den == b.num * a.den;
+}
+
+static size_t busBytes(size_t from) {
+    size_t bytes = 0;
+    for(size_t i = from; i < mockLog.size(); i++) {
+        bytes += 2 + mockLog[i].data.size();
+    }
+    return bytes;
+}
+
+static void setup(int output, int32_t Fclk, si5351DriveStrength_t drive, uint8_t phase) {
+    si5351PLLConfig_t pll_conf;
+    si5351OutputConfig_t out_conf;
+    si5351_Calc(Fclk, &pll_conf, &out_conf);
+    check(si5351_SetupOutput(output, SI5351_PLL_A, drive, &out_conf, phase) == 0, "setup output");
+}
+
+// Reference: what an output gives when it's the only one set up
+static clk_t alone(int32_t Fclk) {
+    mock_Reset();
+    si5351_Init(0);
+    si5351PLLConfig_t pll_conf;
+    si5351OutputConfig_t out_conf;
+    si5351_Calc(Fclk, &pll_conf, &out_conf);
+    si5351_SetupPLL(SI5351_PLL_A, &pll_conf);
+    si5351_SetupOutput(0, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_4MA, &out_conf, 0);
+    return chipClock(0);
+}
+
+int main(void) {
+    const int32_t freqs[] = { 10000000, 500000, 7074000, 80000000 };
+    si5351PLLConfig_t pll_conf;
+    si5351OutputConfig_t out_conf;
+
+    for(size_t k = 0; k < sizeof(freqs)/sizeof(freqs[0]); k++) {
+        int32_t F = freqs[k];
+        clk_t ref = alone(F);
+        clk_t other = alone(F + 1000);
+
+        mock_Reset();
+        si5351_Init(0);
+        si5351_Calc(F, &pll_conf, &out_conf);
+        si5351_SetupPLL(SI5351_PLL_A, &pll_conf);
+        setup(0, F, SI5351_DRIVE_STRENGTH_4MA, 0);
+
+        // Identical CLK1 and CLK2 run from MS0
+        size_t before = mockLog.size();
+        setup(1, F, SI5351_DRIVE_STRENGTH_8MA, 0);
+        size_t sharedBytes = busBytes(before);
+        setup(2, F, SI5351_DRIVE_STRENGTH_2MA, 0);
+        for(int output = 1; output <= 2; output++) {
+            clk_t c = chipClock(output);
+            check(c.ms == 0, "identical output runs from MS0");
+            check(sameFreq(c, ref), "shared output gives the same frequency");
+            check(c.phase == chipClock(0).phase, "shared output has the same phase");
+        }
+        check((mockRegs[17] & 0x3) == SI5351_DRIVE_STRENGTH_8MA, "CLK1 keeps its drive strength");
+        check((mockRegs[18] & 0x3) == SI5351_DRIVE_STRENGTH_2MA, "CLK2 keeps its drive strength");
+
+        si5351Snapshot_t snap;
+        si5351_GetSnapshot(&snap);
+        check(snap.outputs[1].sharesMS0 && snap.outputs[2].sharesMS0, "snapshot reports sharing");
+        check(snap.outputs[1].freq == snap.outputs[0].freq, "snapshot reports the frequency");
+
+        // Separate MS for comparison: same setup with a different phase offset
+        before = mockLog.size();
+        setup(1, F, SI5351_DRIVE_STRENGTH_8MA, 1);
+        size_t ownBytes = busBytes(before);
+        check(chipClock(1).ms == 1, "different phase needs its own MS");
+        check(sameFreq(chipClock(1), ref), "own MS gives the same frequency");
+        printf("%9d Hz: shared %zu bytes, own MS %zu bytes\n", F, sharedBytes, ownBytes);
+        check(sharedBytes < ownBytes / 2, "sharing saves bytes");
+
+        // Back to sharing
+        setup(1, F, SI5351_DRIVE_STRENGTH_8MA, 0);
+        check(chipClock(1).ms == 0, "shares again");
+
+        // CLK0 retuned: CLK1 and CLK2 keep the frequency on their own MS
+        setup(0, F + 1000, SI5351_DRIVE_STRENGTH_4MA, 0);
+        check(sameFreq(chipClock(0), other), "CLK0 retuned");
+        for(int output = 1; output <= 2; output++) {
+            clk_t c = chipClock(output);
+            check(c.ms == output, "un-shared on CLK0 retune");
+            check(sameFreq(c, ref), "un-shared output keeps its frequency");
+        }
+        si5351_GetSnapshot(&snap);
+        check(!snap.outputs[1].sharesMS0 && !snap.outputs[2].sharesMS0, "snapshot reports un-sharing");
+
+        // CLK0 set up again the same way: nothing to un-share, nothing to share
+        setup(0, F + 1000, SI5351_DRIVE_STRENGTH_4MA, 0);
+        check(chipClock(1).ms == 1, "CLK1 stays on its own MS");
+
+        // Shared output retuned on its own
+        setup(1, F + 1000, SI5351_DRIVE_STRENGTH_8MA, 0);
+        check(chipClock(1).ms == 0, "retuned to CLK0 frequency, shares");
+        setup(1, F, SI5351_DRIVE_STRENGTH_8MA, 0);
+        check(chipClock(1).ms == 1, "retuned away, own MS");
+        check(mockLog.back().reg == 17, "source switched after MS1 is programmed");
+        check(sameFreq(chipClock(1), ref), "retuned output on its own MS");
+        check(sameFreq(chipClock(0), other), "CLK0 not affected");
+    }
+
+    // Different PLL: no sharing
+    mock_Reset();
+    si5351_Init(0);
+    si5351_Calc(10000000, &pll_conf, &out_conf);
+    si5351_SetupPLL(SI5351_PLL_A, &pll_conf);
+    si5351_SetupPLL(SI5351_PLL_B, &pll_conf);
+    si5351_SetupOutput(0, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_4MA, &out_conf, 0);
+    si5351_SetupOutput(1, SI5351_PLL_B, SI5351_DRIVE_STRENGTH_4MA, &out_conf, 0);
+    check(chipClock(1).ms == 1, "different PLL needs its own MS");
+
+    // Register images share too and un-share when CLK0 is retuned
+    si5351RegImage_t image, image2;
+    si5351_CalcFast(10000000, &image);
+    si5351_CalcFast(12000000, &image2);
+    si5351_SetupImage(0, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_4MA, &image);
+    si5351_SetupImage(2, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_4MA, &image);
+    clk_t shared = chipClock(2);
+    check(shared.ms == 0, "image output runs from MS0");
+    si5351_SetupImage(0, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_4MA, &image2);
+    check(chipClock(2).ms == 2 && sameFreq(chipClock(2), shared), "image output un-shared");
+
+    // Fractional image: the un-shared MS gets the register values MS0 had
+    si5351_CalcFast(7074123, &image);
+    si5351_SetupImage(0, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_4MA, &image);
+    si5351_SetupImage(1, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_4MA, &image);
+    shared = chipClock(1);
+    check(shared.ms == 0, "fractional image output runs from MS0");
+    si5351_SetupImage(0, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_4MA, &image2);
+    check(chipClock(1).ms == 1 && sameFreq(chipClock(1), shared), "fractional image output un-shared");
+    check(memcmp(&mockRegs[50], image.ms, 8) == 0, "MS1 has the image registers");
+    si5351Snapshot_t snap;
+    si5351_GetSnapshot(&snap);
+    check(snap.outputs[1].freq == 7074123, "snapshot reports the un-shared frequency");
+
+    // Replay after a chip reset restores the routing
+    si5351_SetupImage(2, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_4MA, &image2);
+    check(chipClock(2).ms == 0, "shares again");
+    uint8_t before[256];
+    memcpy(before, mockRegs, sizeof(before));
+    mock_ChipReset();
+    si5351_RecoverBus();
+    check(memcmp(&before[16], &mockRegs[16], 3) == 0, "routing restored after chip reset");
+
+    if(mockFailures) {
+        printf("%d failures\n", mockFailures);
+        return 1;
+    }
+    printf("All done!\n");
+    return 0;
+}
@@ -0,0 +1,164 @@
+// vim: set ai et ts=4 sw=4:
+// si5351_CalcRatio(): outputs are set up on the simulated chip, their MS and R
+// dividers are decoded from the registers into exact fractions and the ratios must
+// hold exactly. Independent si5351_Calc() calls are shown for comparison.
+
+#include <si5351.h>
+#include <stdio.h>
+#include "mock.h"
+
+typedef __int128 int128_t;
+
+static int128_t gcd(int128_t a, int128_t b) {
+    while(b != 0) {
+        int128_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Exact fraction n / d, always reduced
+typedef struct {
+    int128_t n;
+    int128_t d;
+} frac_t;
+
+static frac_t reduce(int128_t n, int128_t d) {
+    int128_t g = gcd(n, d);
+    frac_t f = { n / g, d / g };
+    return f;
+}
+
+static frac_t decode(const uint8_t* regs) {
+    int64_t n, d;
+    mock_Decode(regs, &n, &d, NULL);
+    return reduce(n, d);
+}
+
+// MS * R of an output and the PLL it runs from, from the chip registers
+static frac_t chipDivider(int output, int* pll) {
+    int ms = (((mockRegs[16 + output] >> 2) & 0x3) == 0x2) ? 0 : output;
+    *pll = (mockRegs[16 + ms] >> 5) & 1;
+    frac_t m = decode(&mockRegs[42 + 8 * ms]);
+    int rdiv = (mockRegs[42 + 8 * output + 2] >> 4) & 0x7;
+    return reduce(m.n << rdiv, m.d);
+}
+
+static long double chipFreq(int output, int32_t correction) {
+    int pll;
+    frac_t div = chipDivider(output, &pll);
+    frac_t n = decode(&mockRegs[pll ? 34 : 26]);
+    long double f = 25000000.0L * n.n / n.d * div.d / div.n;
+    return f * (100000000.0L + correction) / 100000000.0L;
+}
+
+typedef struct {
+    const char* name;
+    int32_t Fclk;
+    uint8_t count;
+    si5351Ratio_t ratios[3];
+} case_t;
+
+static void run(const case_t* c, int32_t correction) {
+    si5351PLLConfig_t pll_conf;
+    si5351OutputConfig_t out_confs[3];
+
+    mock_Reset();
+    si5351_Init(correction);
+    int err = si5351_CalcRatio(c->Fclk, c->ratios, c->count, &pll_conf, out_confs);
+    check(err == 0, c->name);
+    if(err != 0) {
+        return;
+    }
+    si5351_SetupPLL(SI5351_PLL_A, &pll_conf);
+    for(uint8_t k = 0; k < c->count; k++) {
+        check(si5351_SetupOutput(k, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_4MA, &out_confs[k], 0) == 0, "setup output");
+    }
+
+    long double maxError = 0;
+    int pll0;
+    frac_t div0 = chipDivider(0, &pll0);
+    for(uint8_t k = 0; k < c->count; k++) {
+        // F_k / F_0 = (MS_0 * R_0) / (MS_k * R_k) = (num_k / den_k) / (num_0 / den_0)
+        int pll;
+        frac_t div = chipDivider(k, &pll);
+        check(pll == pll0, "outputs share the PLL");
+        int128_t lhs = div0.n * div.d * c->ratios[0].num * c->ratios[k].den;
+        int128_t rhs = div0.d * div.n * c->ratios[k].num * c->ratios[0].den;
+        check(lhs == rhs, "ratio is exact");
+
+        long double target = (long double)c->Fclk * c->ratios[k].num / c->ratios[k].den;
+        long double e = chipFreq(k, correction) - target;
+        if(e < 0) e = -e;
+        if(e > maxError) maxError = e;
+    }
+    check(maxError < 0.01L, "absolute error");
+
+    // Independent calculations: every output has its own relative error, the
+    // ratios drift by the spread of these errors
+    long double maxDrift = 0;
+    if(correction == 0) {
+        mock_Reset();
+        si5351_Init(0);
+        si5351PLLConfig_t pll_confs[3];
+        long double lo = 0, hi = 0;
+        for(uint8_t k = 0; k < c->count; k++) {
+            int32_t Fk = (int32_t)((int64_t)c->Fclk * c->ratios[k].num / c->ratios[k].den);
+            si5351_Calc(Fk, &pll_confs[k], &out_confs[k]);
+            si5351_SetupPLL(SI5351_PLL_A, &pll_confs[k]);
+            si5351_SetupOutput(0, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_4MA, &out_confs[k], 0);
+            long double target = (long double)c->Fclk * c->ratios[k].num / c->ratios[k].den;
+            long double ppb = (chipFreq(0, 0) / target - 1) * 1e9L;
+            if(k == 0 || ppb < lo) lo = ppb;
+            if(k == 0 || ppb > hi) hi = ppb;
+        }
+        maxDrift = hi - lo;
+    }
+
+    printf("%-32s corr %5d: PLL %2d + %7d/%7d, max error %.6Lf Hz",
+        c->name, correction, pll_conf.mult, pll_conf.num, pll_conf.denom, maxError);
+    if(correction == 0) {
+        printf(", si5351_Calc() ratio drift up to %.2Lf ppb", maxDrift);
+    }
+    printf("\n");
+}
+
+int main(void) {
+    const case_t cases[] = {
+        { "10 MHz and 4x",                 10000000, 2, { {1, 1}, {4, 1} } },
+        { "7.074 MHz, 3/2 and 5/4",         7074000, 3, { {1, 1}, {3, 2}, {5, 4} } },
+        { "NTSC 14.31818 MHz, 1/4 and 2x",  14318180, 3, { {1, 1}, {1, 4}, {2, 1} } },
+        { "12345678 Hz, 7/3 and 1/13",      12345678, 3, { {1, 1}, {7, 3}, {1, 13} } },
+        { "1 MHz base, 25x 27x 100x",        1000000, 3, { {25, 1}, {27, 1}, {100, 1} } },
+        { "32768 Hz, 1x 2x 1000x",             32768, 3, { {1, 1}, {2, 1}, {1000, 1} } },
+        { "IQ pair + 2x LO, 8.867238 MHz",   8867238, 3, { {1, 1}, {1, 1}, {2, 1} } },
+        { "150 MHz and 1/3",               150000000, 2, { {1, 1}, {1, 3} } },
+    };
+    const int32_t corrections[] = { 0, 970, -1234 };
+
+    for(size_t i = 0; i < sizeof(cases)/sizeof(cases[0]); i++) {
+        for(size_t j = 0; j < sizeof(corrections)/sizeof(corrections[0]); j++) {
+            run(&cases[i], corrections[j]);
+        }
+    }
+
+    // Invalid and impossible constraints
+    si5351PLLConfig_t pll_conf;
+    si5351OutputConfig_t out_confs[3];
+    si5351Ratio_t zero[] = { {1, 1}, {0, 1} };
+    check(si5351_CalcRatio(10000000, zero, 2, &pll_conf, out_confs) == 1, "zero ratio rejected");
+    check(si5351_CalcRatio(10000000, zero, 0, &pll_conf, out_confs) == 1, "no outputs rejected");
+    check(si5351_CalcRatio(10000000, zero, 4, &pll_conf, out_confs) == 1, "too many outputs rejected");
+    si5351Ratio_t far[] = { {1, 1}, {1000, 1} };
+    check(si5351_CalcRatio(10000000, far, 2, &pll_conf, out_confs) == 2, "10 GHz output impossible");
+    si5351Ratio_t wide[] = { {1, 1}, {1, 100000} };
+    check(si5351_CalcRatio(100000000, wide, 2, &pll_conf, out_confs) == 2, "1 kHz next to 100 MHz impossible");
+
+    if(mockFailures) {
+        printf("%d failures\n", mockFailures);
+        return 1;
+    }
+    printf("All done!\n");
+    return 0;
+}
@@ -0,0 +1,278 @@
+// vim: set ai et ts=4 sw=4:
+// Bus scheduler: keying, hops, telemetry reads and background verification compete
+// for the simulated bus. The same load runs with the FIFO policy and with priority
+// classes, keying latency is compared from the per-class histograms.
+
+#include <si5351.h>
+#include <stdio.h>
+#include "mock.h"
+
+#define SIM_MICROS 10000000     // 10 s of load
+#define KEY_MEAN_US 15000       // keying edges, random
+#define HOP_PERIOD_US 20000
+#define TELEMETRY_PERIOD_US 100000
+#define BACKGROUND_PERIOD_US 250000
+
+static uint32_t rng = 12345;
+
+static uint32_t random32(void) {
+    rng = rng * 1664525 + 1013904223;
+    return rng;
+}
+
+static void runAll(void) {
+    while(si5351_RunBus()) {
+    }
+}
+
+// Upper bound of the bucket the p-th fraction of the jobs falls into
+static uint32_t percentile(const si5351ClassStats_t* stats, double p) {
+    uint32_t need = (uint32_t)(stats->completed * p + 0.999);
+    uint32_t seen = 0;
+    for(int i = 0; i < SI5351_LATENCY_BUCKETS; i++) {
+        seen += stats->histogram[i];
+        if(seen >= need) {
+            return 2u << i;
+        }
+    }
+    return UINT32_MAX;
+}
+
+static void setup(void) {
+    mock_Reset();
+    si5351_Init(0);
+    si5351RegImage_t image;
+    si5351_CalcFast(7074000, &image);
+    si5351_SetupImage(0, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_8MA, &image);
+    si5351_CalcFast(10000000, &image);
+    si5351_SetupImage(2, SI5351_PLL_B, SI5351_DRIVE_STRENGTH_4MA, &image);
+    si5351_EnableOutputs(0);
+    runAll();
+    si5351_ResetSchedStats();
+}
+
+// NACKs the first multi-register write
+static int nacks = 0;
+
+static uint8_t nackOnce(uint8_t reg, const uint8_t* data, size_t len, size_t* accepted) {
+    (void)reg;
+    (void)data;
+    if((len > 1) && (nacks == 0)) {
+        nacks++;
+        *accepted = 0;
+        return 3;
+    }
+    return 0;
+}
+
+static void queued(int result) {
+    check(result == 0, "job queued");
+}
+
+typedef struct {
+    uint32_t keys;
+    si5351SchedStats_t stats;
+} simResult_t;
+
+static simResult_t simulate(si5351BusPolicy_t policy) {
+    setup();
+    si5351_SetBusPolicy(policy);
+    rng = 12345;
+
+    uint32_t nextKey = random32() % (2 * KEY_MEAN_US);
+    uint32_t nextHop = HOP_PERIOD_US / 2;
+    uint32_t nextTelemetry = TELEMETRY_PERIOD_US / 3;
+    uint32_t nextBackground = 0;
+    uint32_t keys = 0;
+    uint8_t keyed = 0;
+    int32_t hopFreq = 7074000;
+
+    for(;;) {
+        uint32_t now = mockMicros;
+        uint32_t next = SIM_MICROS;
+        if(nextKey < next) next = nextKey;
+        if(nextHop < next) next = nextHop;
+        if(nextTelemetry < next) next = nextTelemetry;
+        if(nextBackground < next) next = nextBackground;
+
+        if(next <= now && next < SIM_MICROS) {
+            // Submitted by another task at the arrival time, while the bus task is busy
+            mockMicros = next;
+            if(next == nextKey) {
+                keyed ^= 1;
+                queued(si5351_QueueEnableOutputs(SI5351_PRIORITY_URGENT, keyed));
+                keys++;
+                // exponential-ish: sum of two uniform delays
+                nextKey += random32() % KEY_MEAN_US + random32() % KEY_MEAN_US + 1;
+            } else if(next == nextHop) {
+                si5351RegImage_t image;
+                hopFreq = 7000000 + random32() % 300000;
+                si5351_CalcFast(hopFreq, &image);
+                queued(si5351_QueueImage(SI5351_PRIORITY_HIGH, 0, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_8MA, &image));
+                nextHop += HOP_PERIOD_US;
+            } else if(next == nextTelemetry) {
+                queued(si5351_QueueReadback(SI5351_PRIORITY_NORMAL));
+                nextTelemetry += TELEMETRY_PERIOD_US;
+            } else {
+                queued(si5351_QueueReadback(SI5351_PRIORITY_LOW));
+                queued(si5351_QueueRestore(SI5351_PRIORITY_LOW));
+                nextBackground += BACKGROUND_PERIOD_US;
+            }
+            mockMicros = now;
+            continue;
+        }
+
+        if(!si5351_RunBus()) {
+            if(next >= SIM_MICROS) {
+                break;
+            }
+            mockMicros = next; // idle until the next arrival
+        }
+    }
+
+    simResult_t result;
+    result.keys = keys;
+    si5351_GetSchedStats(&result.stats);
+
+    // The chip ends up in the state of the last jobs
+    si5351RegImage_t image;
+    si5351_CalcFast(hopFreq, &image);
+    check(memcmp(&mockRegs[42], image.ms, 8) == 0, "last hop on the chip");
+    check(mockRegs[3] == (uint8_t)~keyed, "last key state on the chip");
+    return result;
+}
+
+static void report(const char* name, const simResult_t* r) {
+    const char* classes[] = { "urgent", "high", "normal", "low" };
+    printf("%s:\n", name);
+    for(int c = 0; c < SI5351_PRIORITIES; c++) {
+        const si5351ClassStats_t* s = &r->stats.classes[c];
+        printf("  %-6s %5u jobs, p50 < %6u us, p99 < %6u us, max %6u us\n", classes[c],
+            s->completed, percentile(s, 0.5), percentile(s, 0.99), s->maxMicros);
+    }
+    printf("  preemptions %u\n", r->stats.preemptions);
+}
+
+int main(void) {
+    // Load: FIFO against priority classes
+    simResult_t fifo = simulate(SI5351_BUS_FIFO);
+    simResult_t prio = simulate(SI5351_BUS_PRIORITY);
+    report("FIFO", &fifo);
+    report("priority classes", &prio);
+
+    const si5351ClassStats_t* fifoKeys = &fifo.stats.classes[SI5351_PRIORITY_URGENT];
+    const si5351ClassStats_t* prioKeys = &prio.stats.classes[SI5351_PRIORITY_URGENT];
+    check(fifoKeys->completed == fifo.keys && prioKeys->completed == prio.keys, "every key edge done");
+    check(fifo.stats.rejected == 0 && prio.stats.rejected == 0, "queue never full");
+    check(fifo.stats.preemptions == 0, "FIFO runs jobs to completion");
+    check(prio.stats.preemptions > 0, "background work preempted");
+    check(percentile(prioKeys, 0.99) < percentile(fifoKeys, 0.99), "urgent p99 improves");
+    check(prioKeys->maxMicros < fifoKeys->maxMicros / 4, "urgent max improves");
+    // one hop in progress plus the key edge itself
+    check(prioKeys->maxMicros < 4000, "urgent waits for at most one step");
+    check(prio.stats.failedBursts == 0, "no failed bursts");
+
+    // Quiet readback: the chip matches the shadow copy
+    si5351SchedStats_t stats;
+    si5351_ResetSchedStats();
+    check(si5351_QueueReadback(SI5351_PRIORITY_LOW) == 0, "readback queued");
+    runAll();
+    si5351_GetSchedStats(&stats);
+    check(stats.readbackMismatches == 0, "readback matches");
+    mockRegs[44] ^= 0x10;
+    si5351_QueueReadback(SI5351_PRIORITY_LOW);
+    runAll();
+    si5351_GetSchedStats(&stats);
+    check(stats.readbackMismatches == 1, "readback finds a changed register");
+
+    // Restore after a chip reset, in chunks
+    setup();
+    uint8_t before[256];
+    memcpy(before, mockRegs, sizeof(before));
+    mock_ChipReset();
+    size_t logStart = mockLog.size();
+    uint32_t resets = mockPLLResets;
+    check(si5351_QueueRestore(SI5351_PRIORITY_LOW) == 0, "restore queued");
+    runAll();
+    check(memcmp(before + 1, mockRegs + 1, 176) == 0 && memcmp(before + 178, mockRegs + 178, 78) == 0, "restored");
+    size_t maxLen = 0;
+    for(size_t i = logStart; i < mockLog.size(); i++) {
+        if(mockLog[i].data.size() > maxLen) maxLen = mockLog[i].data.size();
+    }
+    check(maxLen <= 8, "restore in bounded chunks");
+    check(mockPLLResets == resets + 1, "PLLs reset after restore");
+
+    // Keying goes on during a restore, the other outputs are held disabled
+    setup();
+    si5351_EnableOutputs(1<<2);
+    si5351_QueueEnableOutputs(SI5351_PRIORITY_URGENT, (1<<0) | (1<<2));
+    runAll();
+    si5351_QueueRestore(SI5351_PRIORITY_LOW);
+    si5351_RunBus();
+    check(mockRegs[3] == (uint8_t)~(1<<0), "keyed output stays enabled during a restore");
+    si5351_QueueEnableOutputs(SI5351_PRIORITY_URGENT, (1<<2));
+    si5351_RunBus();
+    check(mockRegs[3] == 0xFF, "key up during a restore");
+    si5351_QueueEnableOutputs(SI5351_PRIORITY_URGENT, (1<<0) | (1<<2));
+    si5351_RunBus();
+    check(mockRegs[3] == (uint8_t)~(1<<0), "key down during a restore, others held");
+    runAll();
+    check(mockRegs[3] == (uint8_t)~((1<<0) | (1<<2)), "all outputs enabled after the restore");
+
+    // A NACK in a restore chunk is retried
+    setup();
+    memcpy(before, mockRegs, sizeof(before));
+    mock_ChipReset();
+    mockFault = nackOnce;
+    nacks = 0;
+    si5351_ResetSchedStats();
+    si5351_QueueRestore(SI5351_PRIORITY_LOW);
+    runAll();
+    mockFault = NULL;
+    si5351_GetSchedStats(&stats);
+    check(nacks == 1 && stats.failedBursts == 0, "restore chunk retried");
+    check(memcmp(before + 1, mockRegs + 1, 176) == 0 && memcmp(before + 178, mockRegs + 178, 78) == 0, "restored after a NACK");
+
+    // Preemption at a burst boundary
+    setup();
+    si5351_QueueReadback(SI5351_PRIORITY_LOW);
+    check(si5351_RunBus() == 1, "first readback chunk");
+    si5351_QueueEnableOutputs(SI5351_PRIORITY_URGENT, 0x1);
+    size_t keyIndex = mockLog.size();
+    check(si5351_RunBus() == 1, "next step");
+    check(mockLog.size() > keyIndex && mockLog[keyIndex].reg == 3, "key edge goes next");
+    runAll();
+    si5351_GetSchedStats(&stats);
+    check(stats.preemptions == 1, "preemption counted");
+    check(stats.classes[SI5351_PRIORITY_LOW].completed == 1, "readback finished after the key edge");
+
+    // Same class: submission order
+    setup();
+    uint8_t a = 0x11, b = 0x22;
+    si5351_QueueWrite(SI5351_PRIORITY_NORMAL, 165, &a, 1);
+    si5351_QueueWrite(SI5351_PRIORITY_NORMAL, 165, &b, 1);
+    runAll();
+    check(mockRegs[165] == 0x22, "same class in order");
+
+    // Invalid arguments and a full queue
+    check(si5351_QueueWrite(SI5351_PRIORITY_NORMAL, 250, &a, 8) == 1, "write past the last register");
+    check(si5351_QueueWrite(SI5351_PRIORITY_NORMAL, 165, &a, 0) == 1, "empty write");
+    check(si5351_QueueEnableOutputs(SI5351_PRIORITIES, 0) == 1, "invalid class");
+    si5351_ResetSchedStats();
+    int queued = 0;
+    while(si5351_QueueEnableOutputs(SI5351_PRIORITY_LOW, 0) == 0) {
+        queued++;
+    }
+    si5351_GetSchedStats(&stats);
+    check(queued > 0 && stats.rejected == 1, "full queue rejects");
+    runAll();
+    si5351_GetSchedStats(&stats);
+    check(stats.classes[SI5351_PRIORITY_LOW].completed == (uint32_t)queued, "queued jobs done");
+
+    if(mockFailures) {
+        printf("%d failures\n", mockFailures);
+        return 1;
+    }
+    printf("All done!\n");
+    return 0;
+}
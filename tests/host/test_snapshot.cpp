@@ -0,0 +1,95 @@
+// vim: set ai et ts=4 sw=4:
+// Stress test for si5351_GetSnapshot(): one writer retunes PLL A as fast as it
+// can, reader threads check that every copy they get is consistent.
+
+#include <si5351.h>
+#include <atomic>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+#include "mock.h"
+
+#define READERS 3
+#define PUBLICATIONS 200000
+
+static std::atomic<int> writerDone(0);
+static std::atomic<uint32_t> torn(0);
+static std::atomic<uint32_t> reads(0);
+
+// Every publication by the writer keeps these relations between the fields
+static int consistent(const si5351Snapshot_t* s) {
+    if(s->outputs[0].freq * 100 != s->pllFreq[0]) return 0;
+    if(s->bytes != 3 * s->transfers || s->transfers != s->pllFreq[0] / 25000000) return 0;
+    if(s->outputs[0].enabled != (s->pllFreq[0] / 25000000) % 2) return 0;
+    return 1;
+}
+
+static void reader(void) {
+    uint32_t lastSequence = 0;
+    uint32_t n = 0;
+    while(!writerDone.load()) {
+        si5351Snapshot_t s;
+        si5351_GetSnapshot(&s);
+        if(!consistent(&s) || s.sequence < lastSequence) {
+            if(torn.fetch_add(1) == 0) {
+                printf("torn copy: seq %u, pll %u, out %u, bytes %u, transfers %u\n",
+                    s.sequence, s.pllFreq[0], s.outputs[0].freq, s.bytes, s.transfers);
+            }
+        }
+        lastSequence = s.sequence;
+        n++;
+    }
+    reads += n;
+}
+
+// EnableOutputs() and SetupPLL() publish separately, so the writer updates the
+// enable bit, the PLL and the bus counters through one raw publication. The setup
+// calls send bursts of any length, bytes = 3 * transfers holds only for the counters
+// set here.
+extern si5351PLLConfig_t si5351PLLSetup[2];
+extern uint32_t si5351Transfers;
+extern uint32_t si5351Bytes;
+extern uint8_t si5351PLLSetupValid[2];
+extern uint8_t si5351Enabled;
+void si5351_publish(void);
+
+int main(void) {
+    mock_Reset();
+    si5351_Init(0);
+
+    si5351PLLConfig_t pll_conf = { 24, 0, 1 };
+    si5351OutputConfig_t out_conf = { 1, 100, 0, 1, SI5351_R_DIV_1 };
+    si5351_SetupPLL(SI5351_PLL_A, &pll_conf);
+    si5351_SetupOutput(0, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_4MA, &out_conf, 0);
+    si5351Enabled = 0;
+    si5351Transfers = 24;
+    si5351Bytes = 3 * 24;
+    si5351_publish();
+
+    std::vector<std::thread> threads;
+    for(int i = 0; i < READERS; i++) {
+        threads.push_back(std::thread(reader));
+    }
+
+    for(uint32_t k = 0; k < PUBLICATIONS; k++) {
+        si5351PLLSetup[SI5351_PLL_A].mult = 24 + k % 13;
+        si5351PLLSetupValid[SI5351_PLL_A] = 1;
+        si5351Enabled = (24 + k % 13) % 2;
+        si5351Transfers = 24 + k % 13;
+        si5351Bytes = 3 * si5351Transfers;
+        si5351_publish();
+    }
+    writerDone = 1;
+
+    for(auto& t : threads) {
+        t.join();
+    }
+
+    printf("%u publications, %u reads by %d readers, %u torn\n",
+        PUBLICATIONS, reads.load(), READERS, torn.load());
+    if(torn.load() != 0 || reads.load() == 0) {
+        return 1;
+    }
+    printf("All done!\n");
+    return 0;
+}
@@ -0,0 +1,196 @@
+// vim: set ai et ts=4 sw=4:
+// si5351_PlanSweep() benchmark: the same frequency lists are programmed with
+// SetupPLL() + SetupOutput() in the caller's order, with si5351_ApplySweepStep()
+// in the caller's order and with the planned order. Every planned step must leave
+// its register image on the chip and cost exactly the bytes it promised.
+
+#include <si5351.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "mock.h"
+
+#define COUNT 200
+#define PLL_LOCK_US 1000 // output is unusable until the PLL locks after a reset
+
+typedef struct {
+    uint32_t bytes;
+    uint32_t resets;
+    uint32_t micros;
+} cost_t;
+
+static uint32_t busBytes(size_t from) {
+    uint32_t bytes = 0;
+    for(size_t i = from; i < mockLog.size(); i++) {
+        bytes += 2 + mockLog[i].data.size();
+    }
+    return bytes;
+}
+
+static void start(void) {
+    mock_Reset();
+    si5351_Init(0);
+    mockLog.clear();
+    mockPLLResets = 0;
+    mockMicros = 0;
+}
+
+static cost_t finish(void) {
+    cost_t c;
+    c.bytes = busBytes(0);
+    c.resets = mockPLLResets;
+    c.micros = mockMicros + mockPLLResets * PLL_LOCK_US;
+    return c;
+}
+
+static cost_t runNaive(const int32_t* freqs, uint16_t count) {
+    start();
+    for(uint16_t i = 0; i < count; i++) {
+        si5351PLLConfig_t pll_conf;
+        si5351OutputConfig_t out_conf;
+        si5351_Calc(freqs[i], &pll_conf, &out_conf);
+        si5351_SetupOutput(0, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_4MA, &out_conf, 0);
+        si5351_SetupPLL(SI5351_PLL_A, &pll_conf);
+    }
+    return finish();
+}
+
+static int compareIndex(const void* a, const void* b) {
+    return (int)((const si5351SweepStep_t*)a)->index - (int)((const si5351SweepStep_t*)b)->index;
+}
+
+static cost_t runSteps(si5351SweepStep_t* steps, uint16_t count, int verify) {
+    start();
+    for(uint16_t i = 0; i < count; i++) {
+        size_t before = mockLog.size();
+        uint32_t resets = mockPLLResets;
+        check(si5351_ApplySweepStep(0, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_4MA, &steps[i]) == 0, "apply step");
+        if(!verify) {
+            continue;
+        }
+        check(memcmp(&mockRegs[26], steps[i].image.pll, 8) == 0, "PLL registers match the image");
+        check(memcmp(&mockRegs[42], steps[i].image.ms, 8) == 0, "MS registers match the image");
+        check(((mockRegs[16] >> 6) & 1) == steps[i].image.intMode, "MS_INT matches the image");
+        check(busBytes(before) == steps[i].bytes, "step costs the planned bytes");
+        check((mockPLLResets - resets) == (steps[i].pllMask ? 1u : 0u), "reset only on PLL change");
+    }
+    return finish();
+}
+
+static void report(const char* name, cost_t c) {
+    printf("  %-18s %6u bytes %4u resets %8u us\n", name, c.bytes, c.resets, c.micros);
+}
+
+static void bench(const char* name, const int32_t* freqs, const uint8_t* segments, uint16_t count, si5351SweepOrder_t order) {
+    static si5351SweepStep_t steps[COUNT];
+
+    printf("%s, %u frequencies:\n", name, count);
+    cost_t naive = runNaive(freqs, count);
+    report("naive", naive);
+
+    check(si5351_PlanSweep(freqs, segments, count, order, steps) == 0, "plan");
+    cost_t planned = runSteps(steps, count, 1);
+
+    // Same deltas, caller's order
+    qsort(steps, count, sizeof(si5351SweepStep_t), compareIndex);
+    cost_t unordered = runSteps(steps, count, 0);
+    report("deltas, unordered", unordered);
+    report("planned", planned);
+
+    check(unordered.bytes < naive.bytes, "deltas beat naive writes");
+    check(planned.resets <= unordered.resets, "planning doesn't add resets");
+    check(planned.micros <= unordered.micros, "planning doesn't add bus time");
+    check(planned.micros < naive.micros, "planned beats naive");
+}
+
+// The planned order visits every frequency once and keeps the segment constraints
+static void checkOrder(const int32_t* freqs, const uint8_t* segments, uint16_t count) {
+    static si5351SweepStep_t steps[COUNT];
+    static uint8_t seen[COUNT];
+
+    check(si5351_PlanSweep(freqs, segments, count, SI5351_SWEEP_MONOTONIC_SEGMENTS, steps) == 0, "plan segments");
+    memset(seen, 0, sizeof(seen));
+    for(uint16_t i = 0; i < count; i++) {
+        check(steps[i].index < count && !seen[steps[i].index], "every frequency visited once");
+        seen[steps[i].index] = 1;
+        check(steps[i].Fclk == freqs[steps[i].index], "step keeps its frequency");
+        if(i > 0) {
+            check(segments[steps[i].index] == segments[steps[i-1].index] ||
+                  segments[steps[i].index] == segments[steps[i-1].index] + 1, "segments keep their order");
+        }
+    }
+
+    uint16_t first = 0;
+    while(first < count) {
+        uint16_t last = first;
+        while(last + 1 < count && segments[steps[last+1].index] == segments[steps[first].index]) {
+            last++;
+        }
+        int up = 1, down = 1;
+        for(uint16_t i = first + 1; i <= last; i++) {
+            if(steps[i].Fclk < steps[i-1].Fclk) up = 0;
+            if(steps[i].Fclk > steps[i-1].Fclk) down = 0;
+        }
+        check(up || down, "segment is monotonic");
+        first = last + 1;
+    }
+}
+
+int main(void) {
+    static int32_t freqs[COUNT];
+    static uint8_t segments[COUNT];
+
+    // Random list over the whole range
+    srand(1);
+    for(int i = 0; i < COUNT; i++) {
+        freqs[i] = 1000000 + rand() % 159000000;
+    }
+    bench("random, any order", freqs, NULL, COUNT, SI5351_SWEEP_ANY_ORDER);
+
+    // Band scans: 40 m up, 2 m down, 80 m down, 10 m up, FM broadcast up.
+    // Each band must stay monotonic, the planner may flip its direction.
+    const struct { int32_t from; int32_t to; } bands[] = {
+        {   7000000,   7200000 },
+        { 146000000, 144000000 },
+        {   3800000,   3500000 },
+        {  28000000,  29700000 },
+        {  88000000, 108000000 },
+    };
+    const int nbands = sizeof(bands)/sizeof(bands[0]);
+    for(int i = 0; i < COUNT; i++) {
+        int band = i * nbands / COUNT;
+        int pos = i - band * COUNT / nbands;
+        int len = COUNT / nbands;
+        segments[i] = band;
+        freqs[i] = bands[band].from + (int32_t)((int64_t)(bands[band].to - bands[band].from) * pos / (len - 1));
+    }
+    bench("band scans, monotonic segments", freqs, segments, COUNT, SI5351_SWEEP_MONOTONIC_SEGMENTS);
+    checkOrder(freqs, segments, COUNT);
+
+    // Segments that alternate between the fixed 900 MHz PLL and the fractional one
+    for(int i = 0; i < COUNT; i++) {
+        segments[i] = i / 10;
+        freqs[i] = ((i / 10) % 2 ? 90000000 : 10000000) + (i % 10) * 12345 * ((i / 10) % 3 + 1);
+    }
+    bench("alternating segments", freqs, segments, COUNT, SI5351_SWEEP_MONOTONIC_SEGMENTS);
+    checkOrder(freqs, segments, COUNT);
+
+    // Argument checks
+    si5351SweepStep_t step;
+    check(si5351_PlanSweep(freqs, NULL, 0, SI5351_SWEEP_ANY_ORDER, &step) == 1, "empty list rejected");
+    for(int i = 0; i < COUNT; i++) {
+        segments[i] = i;
+    }
+    check(si5351_PlanSweep(freqs, segments, COUNT, SI5351_SWEEP_MONOTONIC_SEGMENTS, NULL) == 1, "NULL steps rejected");
+    {
+        static si5351SweepStep_t steps[COUNT];
+        check(si5351_PlanSweep(freqs, segments, COUNT, SI5351_SWEEP_MONOTONIC_SEGMENTS, steps) == 2, "too many segments rejected");
+    }
+    check(si5351_ApplySweepStep(3, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_4MA, &step) == 1, "invalid output rejected");
+
+    if(mockFailures) {
+        printf("%d failures\n", mockFailures);
+        return 1;
+    }
+    printf("All done!\n");
+    return 0;
+}
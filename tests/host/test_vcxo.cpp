@@ -0,0 +1,93 @@
+// vim: set ai et ts=4 sw=4:
+// si5351_TuneVCXO(): fine steps move only the VC voltage, coarse steps and
+// drive strength changes reprogram the chip, PLL B drives a single output.
+
+#include <si5351.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "mock.h"
+
+extern int32_t si5351VCXOCenter;
+
+static uint16_t vcMillivolts = 0;
+static uint32_t vcWrites = 0;
+
+static void setVC(uint16_t millivolts) {
+    vcMillivolts = millivolts;
+    vcWrites++;
+}
+
+// Frequency the chip produces for the current VC voltage, linear pull model
+static double pulledFreq(void) {
+    double offsetPpm = 30.0 * ((double)vcMillivolts - 1650.0) / 1650.0;
+    return si5351VCXOCenter * (1.0 + offsetPpm * 1e-6);
+}
+
+int main(void) {
+    // Si5351A: rejected before anything is written
+    mock_Reset();
+    si5351_Init(0);
+    mockLog.clear();
+    check(si5351_TuneVCXO(0, 7000000, SI5351_DRIVE_STRENGTH_4MA) == 1, "Si5351A rejected");
+    check(mockLog.empty(), "rejected tune on Si5351A doesn't touch the bus");
+    si5351Snapshot_t snap;
+    si5351_GetSnapshot(&snap);
+    check(snap.outputs[0].freq == 0, "rejected tune doesn't set up the output");
+
+    mock_Reset();
+    si5351_Init(0);
+    si5351_SetVariant(SI5351_VARIANT_B);
+    si5351_SetVCOutput(setVC, 3300);
+
+    // Coarse: registers are written, VC covers the residual error
+    check(si5351_TuneVCXO(0, 7000001, SI5351_DRIVE_STRENGTH_4MA) == 0, "coarse tune");
+    size_t transfers = mockLog.size();
+    check(transfers > 0, "coarse tune writes registers");
+    check(llabs((long long)pulledFreq() - 7000001) <= 1, "coarse tune lands on Fclk");
+
+    // Fine: no I2C traffic at all
+    check(si5351_TuneVCXO(0, 7000150, SI5351_DRIVE_STRENGTH_4MA) == 0, "fine tune");
+    check(mockLog.size() == transfers, "fine tune doesn't touch the bus");
+    check(llabs((long long)pulledFreq() - 7000150) <= 1, "fine tune lands on Fclk");
+
+    // Same frequency range, different drive strength: must be written
+    check(si5351_TuneVCXO(0, 7000100, SI5351_DRIVE_STRENGTH_8MA) == 0, "drive strength change");
+    check(mockLog.size() > transfers, "drive strength change writes registers");
+    check((mockRegs[16] & 0x03) == SI5351_DRIVE_STRENGTH_8MA, "drive strength reaches CLK0 control");
+
+    // Requests above 160 MHz are clamped, the center is what the chip gives
+    check(si5351_TuneVCXO(0, 200000000, SI5351_DRIVE_STRENGTH_8MA) == 0, "clamped tune");
+    check(llabs((long long)si5351VCXOCenter - 160000000) <= 7, "center is the programmed frequency");
+    check(vcMillivolts == 1650, "VC stays at VDD/2 for clamped requests");
+    transfers = mockLog.size();
+    check(si5351_TuneVCXO(0, 160000500, SI5351_DRIVE_STRENGTH_8MA) == 0, "fine tune near the clamp");
+    check(mockLog.size() == transfers, "fine tune near the clamp doesn't touch the bus");
+
+    // PLL B already drives CLK0, CLK2 can't be pulled independently
+    transfers = mockLog.size();
+    check(si5351_TuneVCXO(2, 10000000, SI5351_DRIVE_STRENGTH_4MA) == 4, "second output on PLL B rejected");
+    check(mockLog.size() == transfers, "rejected tune doesn't touch the bus");
+
+    si5351PLLConfig_t pll_conf;
+    si5351OutputConfig_t out_conf;
+    si5351_Calc(20000000, &pll_conf, &out_conf);
+    si5351_SetupPLL(SI5351_PLL_A, &pll_conf);
+    si5351_SetupOutput(0, SI5351_PLL_A, SI5351_DRIVE_STRENGTH_4MA, &out_conf, 0);
+    transfers = mockLog.size();
+    check(si5351_TuneVCXO(2, 10000000, SI5351_DRIVE_STRENGTH_4MA) == 0, "CLK2 on PLL B once CLK0 moved to PLL A");
+    for(size_t i = transfers; i < mockLog.size(); i++) {
+        if(mockLog[i].reg == 177) {
+            check(mockLog[i].data[0] == (1<<7), "coarse step resets PLL B only");
+        }
+    }
+
+    si5351_GetSnapshot(&snap);
+    check(snap.outputs[0].pll == SI5351_PLL_A && snap.outputs[2].pll == SI5351_PLL_B, "snapshot PLL assignment");
+
+    if(mockFailures) {
+        printf("%d failures\n", mockFailures);
+        return 1;
+    }
+    printf("All done! %u VC writes\n", vcWrites);
+    return 0;
+}
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+# vim: set ai et ts=4 sw=4:
+
+# Model check of the snapshot latch used by si5351_publish() and si5351_GetSnapshot().
+# The writer and readers are generators, every yield is one memory access, the
+# scheduler interleaves them randomly. A copy is torn if its fields come from
+# different publications.
+
+import random
+import sys
+
+FIELDS = 12 # outputs, PLLs, counters...
+
+class Memory:
+    def __init__(self):
+        self.seq = 0
+        self.copies = [list(range(FIELDS)), list(range(FIELDS))]
+
+def writer(mem, publications):
+    """ Mirrors si5351_publish() """
+    for version in range(1, publications + 1):
+        snapshot = [version * 1000 + i for i in range(FIELDS)]
+        seq = mem.seq
+        yield
+        mem.seq = seq + 1
+        for i in range(FIELDS):
+            yield
+            mem.copies[0][i] = snapshot[i]
+        yield
+        mem.seq = seq + 2
+        for i in range(FIELDS):
+            yield
+            mem.copies[1][i] = snapshot[i]
+
+def reader(mem, results, stats):
+    """ Mirrors si5351_GetSnapshot() """
+    while True:
+        seq = mem.seq
+        yield
+        copy = []
+        for i in range(FIELDS):
+            copy.append(mem.copies[seq & 1][i])
+            yield
+        if mem.seq == seq:
+            break
+        stats['retries'] += 1
+        yield
+    results.append(copy)
+
+def naive_reader(mem, results, stats):
+    """ Single buffer, no sequence check: shows the test catches torn reads """
+    copy = []
+    for i in range(FIELDS):
+        copy.append(mem.copies[0][i])
+        yield
+    results.append(copy)
+
+def torn(copy):
+    return len(set(v // 1000 for v in copy)) != 1 or any(v % 1000 != i for i, v in enumerate(copy))
+
+def run(seed, readers, publications, reader_fn):
+    rnd = random.Random(seed)
+    mem = Memory()
+    results = []
+    stats = {'retries': 0, 'reads': 0}
+    threads = [writer(mem, publications)]
+    while True:
+        if len(threads) < readers + 1:
+            threads.append(reader_fn(mem, results, stats))
+            stats['reads'] += 1
+        t = rnd.randrange(len(threads))
+        try:
+            next(threads[t])
+        except StopIteration:
+            if t == 0:
+                break
+            threads.pop(t)
+    for copy in results:
+        if torn(copy):
+            return copy, stats
+    return None, stats
+
+if __name__ == '__main__':
+    total_reads = 0
+    total_retries = 0
+    for seed in range(500):
+        readers = 1 + seed % 8
+        bad, stats = run(seed, readers, 50, reader)
+        total_reads += stats['reads']
+        total_retries += stats['retries']
+        if bad is not None:
+            print("seed = {}, readers = {} - torn read: {}".format(seed, readers, bad))
+            sys.exit(1)
+    print("{} reads, no torn copies, {} retries".format(total_reads, total_retries))
+
+    caught = sum(1 for seed in range(200) if run(seed, 4, 50, naive_reader)[0] is not None)
+    if caught == 0:
+        print("naive reader never tore - the interleaving is too weak")
+        sys.exit(1)
+    print("naive single-buffer reader tore in {} of 200 runs".format(caught))
+    print("All done!")
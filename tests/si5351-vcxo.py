@@ -0,0 +1,145 @@
+#!/usr/bin/env python3
+# vim: set ai et ts=4 sw=4:
+
+from math import floor
+import sys
+
+Fxtal = 25_000_000
+FINE_PERCENT = 90
+
+def si5351_calc_vcxo(Fclk):
+    Fclk = max(8_000, min(Fclk, 160_000_000))
+
+    rdiv = 0
+    if Fclk < 1_000_000:
+        Fclk *= 64
+        rdiv = 6 # log2(64)
+
+    if Fclk < 81_000_000:
+        X = floor(900_000_000 / Fclk)
+    elif Fclk >= 150_000_000:
+        X = 4
+    elif Fclk >= 100_000_000:
+        X = 6
+    else:
+        X = 8
+
+    Fpll = X*Fclk
+    A = floor(Fpll / Fxtal)
+    B = floor((Fpll % Fxtal) / 25)
+    C = 1_000_000
+
+    if A < 24 or A > 36 or X > 1800 or B > 0xFFFFF:
+        print("Constraint violation: A = {}, B = {}, X = {}".format(A, B, X))
+        return None
+
+    return { 'pll': {'a': A, 'b': B, 'c': C}, 'ms': X, 'rdiv': rdiv }
+
+def vcxo_param(apr, pll):
+    # AN619: VCXO_Param = 1.03 * (128a + b/10^6) * APR
+    return (103 * apr * (128 * pll['a'] * 1_000_000 + pll['b']) + 50_000_000) // 100_000_000
+
+class SimulatedVCXO:
+    """
+    Si5351B with PLL B pulled by VC voltage and an 8-bit DAC driving VC.
+    The pull curve is slightly compressive near the rails like a real varactor.
+    """
+    def __init__(self, apr, vdd_mv = 3300, dac_bits = 8):
+        self.apr = apr
+        self.vdd_mv = vdd_mv
+        self.dac_steps = (1 << dac_bits) - 1
+        self.conf = None
+        self.vc_mv = vdd_mv / 2
+        self.i2c_writes = 0
+        self.dac_writes = 0
+
+    def write_registers(self, conf):
+        # CLK control, MS (8 regs), phase, PLL B (8 regs), reset, VCXO param (3 regs)
+        self.i2c_writes += 1 + 8 + 1 + 8 + 1 + 3
+        self.conf = conf
+
+    def set_vc(self, mv):
+        code = round(mv * self.dac_steps / self.vdd_mv)
+        self.vc_mv = code * self.vdd_mv / self.dac_steps
+        self.dac_writes += 1
+
+    def pull_ppm(self):
+        u = (self.vc_mv - self.vdd_mv / 2) / (self.vdd_mv / 2)
+        return self.apr * (u - 0.002 * u**3)
+
+    def freq(self):
+        pll = self.conf['pll']
+        Fpll = Fxtal * (pll['a'] + pll['b'] / pll['c']) * (1 + self.pull_ppm() * 1e-6)
+        return Fpll / (self.conf['ms'] * (1 << self.conf['rdiv']))
+
+class Driver:
+    """ Mirrors si5351_TuneVCXO() """
+    def __init__(self, chip):
+        self.chip = chip
+        self.center = 0
+
+    def set_offset(self, ppb):
+        rng = self.chip.apr * 1000
+        ppb = max(-rng, min(ppb, rng))
+        half = self.chip.vdd_mv // 2
+        self.chip.set_vc(half + int(ppb * half / rng))
+
+    def tune(self, Fclk):
+        if self.center != 0:
+            ppb = int((Fclk - self.center) * 1_000_000_000 / self.center)
+            if abs(ppb) <= self.chip.apr * 10 * FINE_PERCENT:
+                self.set_offset(ppb)
+                return
+        conf = si5351_calc_vcxo(Fclk)
+        self.chip.write_registers(conf)
+        # offsets are measured from what the registers give at VC = VDD/2
+        pll = conf['pll']
+        self.center = round(Fxtal * (pll['a'] + pll['b'] / pll['c']) / (conf['ms'] * (1 << conf['rdiv'])))
+        self.set_offset(int((Fclk - self.center) * 1_000_000_000 / self.center))
+
+if __name__ == '__main__':
+    # Pull range parameters fit into VCXO_Param[21:0] for every PLL setting
+    for apr in (30, 60, 120, 240):
+        for a in range(24, 37):
+            param = vcxo_param(apr, {'a': a, 'b': 999_999})
+            if param >= (1 << 22):
+                print("apr = {}, a = {} - VCXO_Param overflow: {}".format(apr, a, param))
+                sys.exit(1)
+    print("VCXO_Param range OK")
+
+    # Coarse settings are within 25/MS Hz of the target
+    max_err = 0
+    for Fclk in range(8_000, 160_000_000+1, 997):
+        conf = si5351_calc_vcxo(Fclk)
+        if conf is None:
+            print("{} - no solution".format(Fclk))
+            sys.exit(1)
+        chip = SimulatedVCXO(30)
+        chip.write_registers(conf)
+        err = abs(chip.freq() - Fclk)
+        max_err = max(max_err, err)
+        if err > 25 / conf['ms']:
+            print("Fclk = {}, conf = {} - wrong frequency, err: {}".format(Fclk, conf, err))
+            sys.exit(1)
+    print("Coarse max_err = {:.3f} Hz".format(max_err))
+
+    # Fine steps: tuning walk in 10 Hz steps, error stays within DAC resolution
+    for apr, center in ((30, 7_000_000), (60, 14_200_000), (120, 50_000_000), (240, 144_000_000)):
+        chip = SimulatedVCXO(apr)
+        drv = Driver(chip)
+        span = center * apr * FINE_PERCENT // 100 // 1_000_000
+        dac_step_hz = center * apr * 1e-6 / (chip.dac_steps / 2)
+        max_err = 0
+        drv.tune(center)
+        for Fclk in range(center - 2 * span, center + 2 * span, 10):
+            drv.tune(Fclk)
+            err = abs(chip.freq() - Fclk)
+            max_err = max(max_err, err)
+            # cubic term of the pull curve is 0.2% of APR at the rails
+            limit = dac_step_hz + 0.002 * center * apr * 1e-6 + 7
+            if err > limit:
+                print("Fclk = {}, apr = {} - wrong frequency, err: {:.3f}, limit: {:.3f}".format(Fclk, apr, err, limit))
+                sys.exit(1)
+        print("center = {}, apr = {}: {} DAC writes, {} I2C writes, max_err = {:.3f} Hz".format(
+            center, apr, chip.dac_writes, chip.i2c_writes, max_err))
+    print("All done!")